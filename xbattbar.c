@@ -26,46 +26,92 @@
 static char *ReleaseVersion="1.4.2";
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #ifdef __NetBSD__
 #define ENVSYSUNITNAMES
 #include <sys/param.h>
 #include <sys/envsys.h>
 #include <paths.h>
-#include <stdint.h>
 #endif /* __NetBSD__ */
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <err.h>
 #include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <pthread.h>
+#ifdef linux
+#define USE_TIMERFD
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#endif
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
+#ifdef USE_XCB
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#endif
 
 #define PollingInterval 10	/* APM polling interval in sec */
+#define EventPollingInterval 300	/* fallback for event driven backends */
+#define StatsInterval 60	/* writing counters to a file, in sec */
+
+#ifdef linux
+#define SysfsPowerSupply "/sys/class/power_supply"
+#endif
 
 #define DefaultFont "fixed"
 #define DefaultFontH 14
 #define DefaultFontW 7
 
+/*
+ * battery sample and backend interface
+ */
+struct battery_sample {
+  struct timespec ts;		/* when sampled (CLOCK_MONOTONIC) */
+  int ac_line;			/* AC line status */
+  int level;			/* battery level in percent */
+  int rate;			/* power draw in mW, -1 if unknown */
+  int energy;			/* mWh left, -1 if unknown */
+  int energy_full;		/* mWh when full, -1 if unknown */
+};
+
+struct battery_backend {
+  const char *name;
+  int (*probe)(void);		/* non-zero if usable on this host */
+  int (*open)(void);		/* NULL or -1 on error */
+  int (*sample)(struct battery_sample *);	/* -1 on error */
+  void (*close)(void);		/* NULL or release resources */
+  int (*fd)(void);		/* NULL or fd to wake up on, -1 if none */
+  int (*pending)(void);		/* NULL or fd readable: sample now? */
+};
+
 /*
  * Global variables
  */
 
 int ac_line = -1;               /* AC line status */
 int battery_level = -1;         /* battery level */
-
-unsigned long onin, onout;      /* indicator colors for AC online */
-unsigned long offin, offout;    /* indicator colors for AC offline */
-
-int elapsed_time = 0;           /* for battery remaining estimation */
+static int remain = -1;         /* estimated sec to go, -1 if unknown */
 
 /* indicator default colors */
 char *ONIN_C   = "green";
@@ -76,25 +122,121 @@ char *OFFOUT_C = "red";
 int alwaysontop = False;
 
 int bi_interval = PollingInterval;  /* interval of polling APM */
+int bi_interval_max = 0;            /* adaptive polling upper bound */
+int bi_interval_hidden = 0;         /* polling while nothing is seen */
+int timer_slack = 0;                /* align polling wakeups, in msec */
 
-Display *disp;
-int scr;
-Window win;
-Atom wm_delete_window;
-GC gc_fill, gc_text, gc_frame;
-XEvent theEvent;
-XFontStruct *fontp = NULL;
+#ifdef linux
+static const char *sysfs_root = SysfsPowerSupply; /* power_supply class dir */
+static int use_uevent = False;  /* wake up on power_supply uevents */
+#endif
 
-static unsigned long pix_bg = 0;
-static unsigned long pix_fg = 0;
+static char *replay_file = NULL;   /* trace to replay */
+static int replay_fast = False;    /* replay as fast as possible */
+static char *shm_file = NULL;      /* samples published by another */
+static const char *persist_path = NULL;	/* history across restarts, -k */
+static int persist_off = False;		/* -K */
+static const char *event_path = NULL;	/* status stream, -E */
+static int sample_timeout = 0;	/* msec, sample in a thread if > 0 */
+
+#define MAX_DISPLAYS	8
+#define MAX_WIDGETS	16
+
+static const char *display_names[MAX_DISPLAYS];	/* -D, none: $DISPLAY */
+static int ndisplay_names = 0;
+static int all_screens = False;	/* a widget on every screen */
+static int history_mode = False;	/* a graph of the last samples, -H */
+
+XEvent theEvent;
 
 static const char *font_name = DefaultFont;
 static char *wm_name   = "xbattbar";
 
-static unsigned int win_w = 64, win_h = 16;
+static unsigned int win_w = 64, win_h = 16;	/* initial size, from -g */
 static int win_x = 0, win_y = 0;
 static int have_x = 0, have_y = 0;
 
+/*
+ * performance counters
+ */
+#define STATS_HIST	16	/* log2 buckets of sampling latency in usec */
+
+struct counters {
+  unsigned long wakeups;	/* main loop iterations */
+  unsigned long wakeups_timer;
+  unsigned long wakeups_x;
+  unsigned long wakeups_backend;
+  unsigned long samples;	/* battery_check() calls */
+  unsigned long sample_hist[STATS_HIST];
+  unsigned long samples_timeout;	/* sampler thread too slow, -w */
+  unsigned long redraws;
+  unsigned long redraws_skipped;	/* samples and configures not drawn */
+  unsigned long flushes;
+  unsigned long roundtrips;
+  unsigned long tip_shows;
+  unsigned long tip_moves;
+  unsigned long events;		/* status stream lines queued */
+  unsigned long events_dropped;	/* overwritten before written */
+};
+
+static struct counters stats;
+
+/*
+ * synchronous requests which wait for a reply from the server;
+ * the steady state (redraws and tooltip) must not issue any of them
+ */
+#define ROUNDTRIP(call) (stats.roundtrips++, (call))
+
+static int debug = False;
+
+/*
+ * startup trace (-T): where the time to the first frame goes
+ */
+enum {
+  STARTUP_BACKEND, STARTUP_CONNECT, STARTUP_RESOURCES, STARTUP_WINDOW,
+  STARTUP_SAMPLE, STARTUP_FRAME, STARTUP_PHASES
+};
+
+static const char *startup_names[STARTUP_PHASES] = {
+  "backend", "connect", "resources", "window", "sample", "first frame"
+};
+
+static int startup_trace = False;
+static struct timespec startup_start, startup_mark;
+static long startup_us[STARTUP_PHASES];
+static unsigned long startup_rt[STARTUP_PHASES];	/* round trips */
+static unsigned long startup_last_rt;
+
+/* pre-rendered percentage labels, indexed by percentage */
+#define LABEL_MAX	101
+
+struct label {
+  int valid;
+  Pixmap pix;			/* text and shadow, or None */
+  Pixmap mask;			/* clip mask of pix */
+  unsigned int w, h;		/* size of pix */
+  int x, y;			/* text origin in pix */
+  int tw;			/* text width */
+};
+
+/* what has to be repainted by the next redraw() */
+#define DAMAGE_STATE	0x01	/* battery state changed: render again */
+#define DAMAGE_SIZE	0x02	/* widget resized */
+#define DAMAGE_EXPOSE	0x04	/* damage_rect of the widget exposed */
+#define DAMAGE_TIP	0x08	/* tooltip exposed or moved */
+#define DAMAGE_TEXT	0x10	/* tooltip text changed */
+#define DAMAGE_HIST	0x20	/* new sample for the history graph */
+#define DAMAGE_MOVE	0x40	/* pointer moved, tooltip follows */
+
+/*
+ * history of samples for -H, one column each, newest at the right
+ */
+#define HISTORY_MAX	1024
+
+static unsigned char history_level[HISTORY_MAX];
+static unsigned char history_ac[HISTORY_MAX];
+static unsigned long history_serial = 0;	/* samples ever added */
+
 /* for tooltip to display status */
 #define TIP_PAD_X	6
 #define TIP_PAD_Y	4
@@ -102,33 +244,106 @@ static int have_x = 0, have_y = 0;
 #define TIP_MSGLEN	128
 #define TIP_DELAY	1000    /* ms */
 
-static Window tip = (Window)0;
-static int tip_mapped = 0;
 static unsigned int tip_pad_x = TIP_PAD_X, tip_pad_y = TIP_PAD_Y;
 static char tipmsg[TIP_MSGLEN];
+static unsigned long tipmsg_serial = 0;	/* bumped when tipmsg changes */
 static const int tip_delay_ms = TIP_DELAY;
-static int tip_hovering = 0;
-static struct timespec tip_disp = { 0 };
-static int tip_xroot = 0, tip_yroot = 0;
+
+/*
+ * X displays and the widgets on their screens:
+ * a display connection, its atoms and font are shared by the widgets
+ * on its screens; colors, GCs, pixmaps, damage and the tooltip belong
+ * to each widget.  All of them are fed by the same samples.
+ */
+struct xdisplay {
+  Display *disp;
+  Atom wm_delete_window, wm_protocols;
+  XFontStruct *fontp;		/* loaded on first use */
+  int font_tried;
+  unsigned long flushed;	/* XNextRequest() at the last flush */
+};
+
+struct widget {
+  struct xdisplay *dp;
+  Display *disp;		/* dp->disp */
+  int scr;
+  Window win;
+  int closed;			/* deleted by the window manager */
+  int mapped, obscured;		/* nothing is drawn unless seen */
+
+  unsigned long onin, onout;	/* indicator colors for AC online */
+  unsigned long offin, offout;	/* indicator colors for AC offline */
+  unsigned long pix_bg, pix_fg;
+  GC gc_fill, gc_text, gc_frame;
+  XFontStruct *fontp;		/* dp->fontp, see widget_font() */
+  unsigned int win_w, win_h;	/* kept by ConfigureNotify */
+
+  /* off-screen image of the widget */
+  Pixmap win_pix;
+  unsigned int pix_w, pix_h;
+
+  struct label labels[LABEL_MAX];
+  Font label_font;		/* font the labels were drawn with */
+  GC gc_label;
+
+  unsigned int damage;		/* what the next redraw() repaints */
+  XRectangle damage_rect;
+  unsigned long history_seen;	/* history_serial drawn into win_pix */
+
+  Window tip;
+  int tip_mapped;
+  unsigned int tip_w, tip_h;
+  int tip_x, tip_y;		/* where the tooltip is */
+  unsigned long tip_serial;	/* tipmsg_serial measured for */
+  int in_win, in_tip;		/* pointer containment */
+  int tip_hovering;
+  int tip_timer;
+  int tip_xroot, tip_yroot;
+  int left;			/* pointer left a window, hide the tip? */
+};
+
+static struct xdisplay displays[MAX_DISPLAYS];
+static int ndisplays = 0;
+static struct widget widgets[MAX_WIDGETS];
+static int nwidgets = 0;
 
 /*
  * function prototypes
  */
-void InitDisplay(void);
-Status AllocColor(char *, unsigned long *);
+struct xdisplay *InitDisplay(const char *);
+void InitWidget(struct xdisplay *, int);
+Status AllocColor(struct widget *, char *, unsigned long *);
 void battery_check(void);
-void redraw(void);
+int sampler_start(void);
+void sampler_request(void);
+int sampler_collect(void);
+void battery_update(const struct battery_sample *);
+void record_open(const char *);
+void shm_publish_open(const char *);
+void persist_open(const char *);
+void persist_load(void);
+void backend_list(void);
+void backend_open(const char *);
+void backend_close(void);
+int backend_fd(void);
+int backend_pending(void);
+void redraw(struct widget *);
 void usage(char **);
 void about_this_program(void);
+void estimate_update(const struct battery_sample *);
 void estimate_remain(void);
+int poll_interval(void);
+void poll_update(void);
 
-static int pointer_in_window(Window);
-static int pointer_in_windows(void);
+static void damage_all(unsigned int);
+static int widgets_visible(void);
+static void damage_expose(struct widget *, XExposeEvent *);
+static int pointer_in_windows(struct widget *);
 static void tip_format(void);
-static void tip_ensure_created(void);
-static void tip_show(int root_x, int root_y);
-static void tip_draw(void);
-static void tip_hide(void);
+static void tip_ensure_created(struct widget *);
+static void tip_show(struct widget *, int root_x, int root_y);
+static void tip_draw(struct widget *);
+static void tip_hide(struct widget *);
 
 /*
  * usage of this command
@@ -145,15 +360,55 @@ void usage(char **argv)
 {
   fprintf(stderr,
     "\n"	  
-    "usage:\t%s [-h|v] [-g geometry] [-p sec]\n"
+    "usage:\t%s [-h|v] [-d] [-T] [-C file] [-g geometry] [-B backend]\n"
+    "\t\t[-p sec] [-P sec] [-q sec] [-A msec] [-w msec]\n"
     "\t\t[-I color] [-O color] [-i color] [-o color] [-F font]\n"
+    "\t\t[-R trace] [-r trace [-f]] [-S file] [-m file] [-k file | -K]\n"
+    "\t\t[-D display ...] [-x] [-H] [-E stream]\n",
+	  argv[0]);
+#ifdef linux
+  fprintf(stderr,
+    "\t\t[-s sysfs-dir] [-u]\n");
+#endif
+  fprintf(stderr,
     "-v, -h: show this message.\n"
+    "-d:     print debug counters to stderr.\n"
+    "-T:     print how long startup took, by phase, to stderr.\n"
+    "-C:     write performance counters to a file every %d sec.\n"
+    "        (SIGUSR1 dumps them to stderr at any time)\n"
+    "-E:     write status as JSON lines to a FIFO, socket or file.\n"
     "-g:     set window geometry (WxH+X+Y).\n"
+    "-H:     show a graph of the recent samples instead of a bar.\n"
+    "-D:     show on this display, may be repeated. [def: $DISPLAY]\n"
+    "-x:     show on every screen of each display.\n"
     "-p:     polling interval. [def: 10 sec.]\n"
+    "-P:     adapt polling between -p and this interval, in sec.\n"
+    "-q:     polling interval while no widget can be seen, in sec.\n"
+    "-A:     align polling wakeups to multiples of msec. [def: 0]\n"
+    "-w:     sample in a separate thread, giving up after msec.\n"
     "-I, -O: bar colors in AC on-line. [def: \"green\" & \"olive drab\"]\n"
     "-i, -o: bar colors in AC off-line. [def: \"blue\" and \"red\"]\n"
-    "-F:     font name. [def: \"fixed\"]\n",
-	  argv[0]);
+    "-F:     font name. [def: \"fixed\"]\n"
+    "-B:     battery backend, one of:",
+	  StatsInterval);
+  backend_list();
+  fprintf(stderr,
+    "\n"
+    "        [def: the first available one]\n"
+    "-R:     record samples to a trace file.\n"
+    "-r:     replay samples from a trace file at the original pace.\n"
+    "-f:     replay as fast as possible.\n"
+    "-S:     publish samples in a file for other instances.\n"
+    "-m:     read samples published by another instance with -S.\n"
+    "-k:     keep recent samples in this file across restarts.\n"
+    "        [def: \"$XDG_RUNTIME_DIR/xbattbar.history\"]\n"
+    "-K:     don't keep samples across restarts.\n");
+#ifdef linux
+  fprintf(stderr,
+    "-s:     sysfs power_supply directory. [def: \"%s\"]\n"
+    "-u:     update on kernel uevents, poll every %d sec. as a fallback.\n",
+	  SysfsPowerSupply, EventPollingInterval);
+#endif
   exit(0);
 }
 
@@ -208,666 +463,3241 @@ timespec_cmp(struct timespec *tsp, struct timespec *usp)
 }
 
 /*
- * AllocColor:
- * convert color name to pixel value
+ * main loop scheduler:
+ * timers with absolute CLOCK_MONOTONIC deadlines and file descriptors
+ * to wait for.  On Linux every timer is a timerfd and everything is
+ * waited for with epoll; elsewhere select() sleeps until the nearest
+ * deadline.  A timer may be given a slack, which rounds its deadline
+ * up to a multiple of the slack so that wakeups of this and other
+ * processes using the same alignment coalesce.
  */
-Status AllocColor(char *name, unsigned long *pixel)
-{
-  XColor color,exact;
-  int status;
 
-  status = XAllocNamedColor(disp, DefaultColormap(disp, scr),
-                           name, &color, &exact);
-  *pixel = color.pixel;
+#define SCHED_MAXTIMER	(4 + MAX_WIDGETS)
+#define SCHED_MAXFD	(4 + MAX_DISPLAYS)
 
-  return(status);
-}
+struct sched_timer {
+  int active;
+  int expired;
+  struct timespec deadline;
+#ifdef USE_TIMERFD
+  int fd;
+#endif
+};
+
+static struct sched_timer sched_timers[SCHED_MAXTIMER];
+static int sched_ntimers = 0;
+static int sched_fds[SCHED_MAXFD];
+static int sched_ready[SCHED_MAXFD];
+static int sched_nfds = 0;
+#ifdef USE_TIMERFD
+static int sched_epfd = -1;
+#define SCHED_TIMER_TAG	0x10000	/* epoll data of timers */
+#endif
 
-/*
- * InitDisplay:
- * create a window for WM Swallow
- */
-void InitDisplay(void)
+static void sched_init(void)
 {
-
-  if((disp = XOpenDisplay(NULL)) == NULL) {
-      fprintf(stderr, "xbattbar: can't open display.\n");
-      exit(1);
-  }
-  scr = DefaultScreen(disp);
-  pix_bg = WhitePixel(disp, scr);
-  pix_fg = BlackPixel(disp, scr);
-
-  if (!AllocColor(ONIN_C,&onin) ||
-       !AllocColor(OFFOUT_C,&offout) ||
-       !AllocColor(OFFIN_C,&offin) ||
-       !AllocColor(ONOUT_C,&onout)) {
-    fprintf(stderr, "xbattbar: can't allocate color resources\n");
+#ifdef USE_TIMERFD
+  if ((sched_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perror("xbattbar: epoll_create1");
     exit(EXIT_FAILURE);
   }
-
-  XSetWindowAttributes attr = {0};
-  attr.background_pixel = pix_bg;
-  attr.event_mask = ExposureMask | StructureNotifyMask |
-    EnterWindowMask | LeaveWindowMask | PointerMotionMask;
-
-  win = XCreateWindow(disp, RootWindow(disp, scr),
-                      have_x ? win_x : 0, have_y ? win_y : 0,
-                      win_w, win_h,
-                      0,
-                      DefaultDepth(disp, scr),
-                      InputOutput,
-                      DefaultVisual(disp, scr),
-                      CWBackPixel | CWEventMask,
-                      &attr
-    );
-
-  /* set WM_NAME / CLASS for WM Swallow */
-  XStoreName(disp, win, wm_name);
-  XClassHint ch;
-  ch.res_name  = wm_name;
-  ch.res_class = (char *)"Xbattbar";
-  XSetClassHint(disp, win, &ch);
-
-  gc_fill  = XCreateGC(disp, win, 0, NULL);
-  gc_frame = XCreateGC(disp, win, 0, NULL);
-
-  fontp = XLoadQueryFont(disp, font_name);
-  if (fontp == NULL)
-    fontp = XLoadQueryFont(disp, "fixed");
-  if (fontp != NULL) {
-    XGCValues gv = {0};
-    gv.font = fontp->fid;
-    gc_text = XCreateGC(disp, win, GCFont, &gv);
+  if (timer_slack > 0) {
+    /* also let the kernel defer our other sleeps */
+    prctl(PR_SET_TIMERSLACK, (unsigned long)timer_slack * 1000000UL);
   }
+#endif
+}
 
-  XMapWindow(disp, win);
+static int sched_timer_new(void)
+{
+  struct sched_timer *tp;
 
-  wm_delete_window = XInternAtom(disp, "WM_DELETE_WINDOW", False);
-  XSetWMProtocols(disp, win, &wm_delete_window, 1);
+  if (sched_ntimers >= SCHED_MAXTIMER) {
+    fprintf(stderr, "xbattbar: too many timers\n");
+    exit(EXIT_FAILURE);
+  }
+  tp = &sched_timers[sched_ntimers];
+  tp->active = tp->expired = 0;
+#ifdef USE_TIMERFD
+  {
+    struct epoll_event ev;
+
+    tp->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.u32 = SCHED_TIMER_TAG | sched_ntimers;
+    if (tp->fd < 0 || epoll_ctl(sched_epfd, EPOLL_CTL_ADD, tp->fd, &ev) < 0) {
+      perror("xbattbar: timerfd");
+      exit(EXIT_FAILURE);
+    }
+  }
+#endif
+  return sched_ntimers++;
 }
 
-int main(int argc, char **argv)
+/*
+ * sched_timer_set:
+ * arm a one-shot timer; slack (in msec) rounds the deadline up
+ */
+static void sched_timer_set(int id, const struct timespec *deadline,
+                            int slack)
 {
-  int ch;
-  char *geom = NULL;
-  Atom proto;
-  struct timespec next;
-  int xfd;
-
-  about_this_program();
-  while ((ch = getopt(argc, argv, "g:F:hI:i:O:o:p:v")) != -1)
-    switch (ch) {
-    case 'I':
-      ONIN_C = optarg;
-      break;
-    case 'i':
-      OFFIN_C = optarg;
-      break;
-    case 'O':
-      ONOUT_C = optarg;
-      break;
-    case 'o':
-      OFFOUT_C = optarg;
-      break;
+  struct sched_timer *tp = &sched_timers[id];
 
-    case 'F':
-      font_name = optarg;
-      break;
+  tp->deadline = *deadline;
+  if (slack > 0) {
+    long long ns = (long long)deadline->tv_sec * 1000000000 +
+      deadline->tv_nsec;
+    long long q = (long long)slack * 1000000;
 
-    case 'g':
-      geom = optarg;
-      break;
+    ns = (ns + q - 1) / q * q;
+    tp->deadline.tv_sec = ns / 1000000000;
+    tp->deadline.tv_nsec = ns % 1000000000;
+  }
+  tp->active = 1;
+  tp->expired = 0;
+#ifdef USE_TIMERFD
+  {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value = tp->deadline;
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+      its.it_value.tv_nsec = 1;	/* zero would disarm it */
+    timerfd_settime(tp->fd, TFD_TIMER_ABSTIME, &its, NULL);
+  }
+#endif
+}
 
-    case 'p':
-      bi_interval = atoi(optarg);
-      break;
+static void sched_timer_cancel(int id)
+{
+  struct sched_timer *tp = &sched_timers[id];
 
-    case 'h':
-    case 'v':
-      usage(argv);
-      break;
-    }
+  tp->active = tp->expired = 0;
+#ifdef USE_TIMERFD
+  {
+    struct itimerspec its;
 
-  if (geom) {
-    int x, y;
-    unsigned int w, h;
-    int flags = XParseGeometry(geom, &x, &y, &w, &h);
-    if (flags & WidthValue) {
-      win_w = w;
-    }
-    if (flags & HeightValue) {
-      win_h = h;
-    }
-    if (flags & XValue) {
-      have_x = 1;
-      win_x = x;
-    }
-    if (flags & YValue) {
-      have_y = 1;
-      win_y = y;
-    }
+    memset(&its, 0, sizeof(its));
+    timerfd_settime(tp->fd, TFD_TIMER_ABSTIME, &its, NULL);
   }
+#endif
+}
 
-  /*
-   * X Window main loop
-   */
-  InitDisplay();
-  battery_check();
-  clock_gettime(CLOCK_MONOTONIC, &next);
-  timespec_add_msec(&next, (time_t)bi_interval * 1000);
-  xfd = ConnectionNumber(disp);
-  proto = XInternAtom(disp, "WM_PROTOCOLS", False);
-  while (1) {
-    fd_set fds;
-    struct timespec now, wait, hoverwait;
-    struct timeval tv;
-    int rv;
-
-    FD_ZERO(&fds);
-    FD_SET(xfd, &fds);
-
-    /* Calculate wait time to poll the next battery status */
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    timespec_sub(&next, &now, &wait);
+/*
+ * sched_timer_expired:
+ * true once after the timer has fired
+ */
+static int sched_timer_expired(int id)
+{
+  struct sched_timer *tp = &sched_timers[id];
 
-    /* Calculate wait time for delayed tooltip */
-    if (tip_hovering && !tip_mapped) {
-      timespec_sub(&tip_disp, &now, &hoverwait);
-      if (timespec_cmp(&wait, &hoverwait) > 0) {
-        wait = hoverwait;
-      }
-    }
+  if (!tp->expired)
+    return 0;
+  tp->expired = 0;
+  return 1;
+}
 
-    tv.tv_sec = wait.tv_sec;
-    tv.tv_usec = wait.tv_nsec / 1000;
-    rv = select(xfd + 1, &fds, NULL, NULL, &tv);
-    if (rv < 0) {
-      if (errno == EINTR) {
-        continue;
-      }
-      perror("select");
+static void sched_add_fd(int fd)
+{
+  if (sched_nfds >= SCHED_MAXFD) {
+    fprintf(stderr, "xbattbar: too many file descriptors\n");
+    exit(EXIT_FAILURE);
+  }
+#ifdef USE_TIMERFD
+  {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.u32 = sched_nfds;
+    if (epoll_ctl(sched_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      perror("xbattbar: epoll_ctl");
       exit(EXIT_FAILURE);
     }
-    if (rv > 0 && FD_ISSET(xfd, &fds)) {
-      while (XPending(disp) > 0) {
-        XNextEvent(disp, &theEvent);
-        switch (theEvent.type) {
-        case Expose:
-          if (theEvent.xexpose.window == win) {
-            redraw();
-          } else if (theEvent.xexpose.window == tip) {
-            tip_draw();
-          }
-          break;
-        case ConfigureNotify:
-          redraw();
-          break;
-
-        case EnterNotify:
-          if (theEvent.xcrossing.window == win) {
-            tip_hovering = 1;
-            clock_gettime(CLOCK_MONOTONIC, &tip_disp);
-            timespec_add_msec(&tip_disp, tip_delay_ms);
-            tip_xroot = theEvent.xcrossing.x_root;
-            tip_yroot = theEvent.xcrossing.y_root;
-          }
-          break;
-        case LeaveNotify:
-          if (theEvent.xcrossing.window == win) {
-            tip_hovering = 0;
-            if (!pointer_in_windows()) {
-              tip_hide();
-            }
-          } else if (theEvent.xcrossing.window == tip) {
-            if (!pointer_in_windows()) {
-              tip_hide();
-            }
-          }
-          break;
-        case MotionNotify:
-          tip_xroot = theEvent.xmotion.x_root;
-          tip_yroot = theEvent.xmotion.y_root;
-          if (tip_mapped) {
-            tip_show(tip_xroot, tip_yroot);
-          }
-          break;
-
-        case ClientMessage:
-          if (theEvent.xclient.message_type == proto &&
-              (Atom)theEvent.xclient.data.l[0] == wm_delete_window) {
-            goto out;
-          }
-        }
-      }
-    }
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    if (timespec_cmp(&now, &next) >= 0) {
-      battery_check();
-      while (timespec_cmp(&now, &next) >= 0) {
-        timespec_add_msec(&next, bi_interval * 1000);
-      }
-    }
-    if (tip_hovering && !tip_mapped) {
-      clock_gettime(CLOCK_MONOTONIC, &now);
-      if (timespec_cmp(&now, &tip_disp) > 0) {
-        tip_show(tip_xroot, tip_yroot);
-      }
-    }
   }
-
- out:
-  exit(EXIT_SUCCESS);
+#endif
+  sched_fds[sched_nfds] = fd;
+  sched_ready[sched_nfds] = 0;
+  sched_nfds++;
 }
 
-static void draw_widget(void)
+static int sched_fd_ready(int fd)
 {
-  XWindowAttributes wa;
-  unsigned int width, height, margin, bx, by, bw, bh, fill_w;
-  unsigned int pct;
-  unsigned long col_in, col_out;
-
-  XGetWindowAttributes(disp, win, &wa);
-  width = wa.width;
-  height = wa.height;
-
-  /* background (white) */
-  XSetForeground(disp, gc_fill, pix_bg);
-  XFillRectangle(disp, win, gc_fill, 0, 0, width, height);
-
-  /* frame (black) */
-  margin = (width < 32 || height < 12) ? 1u : 2u;
-  bx = by = margin;
-  bw = (width > margin * 2U) ? (width - margin * 2U) : width;
-  bh = (height > margin * 2U) ? (height - margin * 2U) : height;
+  int i;
 
-  XSetForeground(disp, gc_frame, pix_fg);
-  if (bw > 1U && bh > 1U)
-    XDrawRectangle(disp, win, gc_frame, bx, by, bw - 1, bh - 1);
+  for (i = 0; i < sched_nfds; i++) {
+    if (sched_fds[i] == fd)
+      return sched_ready[i];
+  }
+  return 0;
+}
 
-  /* draw battery capacity */
-  pct = (battery_level < 0) ? 0U :
-    (battery_level > 100 ? 100U : (unsigned int)battery_level);
-  col_in  = ac_line ? onin  : offin;
-  col_out = ac_line ? onout : offout;
+/*
+ * sched_wait:
+ * sleep until a timer fires or a file descriptor becomes readable;
+ * with nowait, only collect what is ready already
+ */
+static void sched_wait(int nowait)
+{
+  struct timespec now;
+  int i, rv;
+#ifdef USE_TIMERFD
+  struct epoll_event evs[SCHED_MAXTIMER + SCHED_MAXFD];
+
+  for (i = 0; i < sched_nfds; i++)
+    sched_ready[i] = 0;
+  do {
+    rv = epoll_wait(sched_epfd, evs, SCHED_MAXTIMER + SCHED_MAXFD,
+                    nowait ? 0 : -1);
+  } while (rv < 0 && errno == EINTR);
+  if (rv < 0) {
+    perror("epoll_wait");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < rv; i++) {
+    uint32_t n = evs[i].data.u32;
 
-  if (bw > 2U && bh > 2U) {
-    XSetForeground(disp, gc_fill, col_out);
-    XFillRectangle(disp, win, gc_fill, bx + 1U, by + 1U, bw - 2U, bh - 2U);
+    if (n & SCHED_TIMER_TAG) {
+      uint64_t count;
 
-    fill_w = (bw - 2U) * pct / 100U;
-    XSetForeground(disp, gc_fill, col_in);
-    if (fill_w > 0U)
-      XFillRectangle(disp, win, gc_fill, bx + 1U, by + 1U, fill_w, bh - 2U);
+      n &= ~SCHED_TIMER_TAG;
+      if (read(sched_timers[n].fd, &count, sizeof(count)) < 0 &&
+          errno != EAGAIN)
+        perror("xbattbar: timerfd");
+    } else {
+      sched_ready[n] = 1;
+    }
+  }
+#else /* !USE_TIMERFD */
+  fd_set fds;
+  struct timeval tv, *tvp = NULL;
+  struct timespec wait;
+  int maxfd = -1, nearest = -1;
+
+  FD_ZERO(&fds);
+  for (i = 0; i < sched_nfds; i++) {
+    sched_ready[i] = 0;
+    FD_SET(sched_fds[i], &fds);
+    if (sched_fds[i] > maxfd)
+      maxfd = sched_fds[i];
+  }
+  for (i = 0; i < sched_ntimers; i++) {
+    if (sched_timers[i].active &&
+        (nearest < 0 || timespec_cmp(&sched_timers[i].deadline,
+                                     &sched_timers[nearest].deadline) < 0))
+      nearest = i;
+  }
+  if (nowait) {
+    tv.tv_sec = tv.tv_usec = 0;
+    tvp = &tv;
+  } else if (nearest >= 0) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timespec_sub(&sched_timers[nearest].deadline, &now, &wait);
+    tv.tv_sec = wait.tv_sec;
+    /* round up, or we wake up just before the deadline */
+    tv.tv_usec = (wait.tv_nsec + 999) / 1000;
+    if (tv.tv_usec >= 1000000) {
+      /* select() rejects a full second in tv_usec */
+      tv.tv_sec++;
+      tv.tv_usec = 0;
+    }
+    tvp = &tv;
+  }
+  rv = select(maxfd + 1, &fds, NULL, NULL, tvp);
+  if (rv < 0) {
+    if (errno == EINTR)
+      return;
+    perror("select");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < sched_nfds; i++) {
+    if (FD_ISSET(sched_fds[i], &fds))
+      sched_ready[i] = 1;
   }
+#endif /* USE_TIMERFD */
 
-  /* capacity percentage */
-  if (fontp != NULL && gc_text != 0) {
-    char buf[8];
-    int len = snprintf(buf, sizeof(buf), "%u%%", pct);
-    int tw = XTextWidth(fontp, buf, len);
-    int tx = (int)(width - tw) / 2;
-    int ty = (int)(height + fontp->ascent - fontp->descent) / 2;
+  /* the deadline decides, so a late or early wakeup can't confuse us */
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (i = 0; i < sched_ntimers; i++) {
+    struct sched_timer *tp = &sched_timers[i];
 
-    XSetForeground(disp, gc_text, pix_bg);
-    XDrawString(disp, win, gc_text, tx + 1, ty + 1, buf, len);
-    XSetForeground(disp, gc_text, pix_fg);
-    XDrawString(disp, win, gc_text, tx, ty, buf, len);
+    if (tp->active && timespec_cmp(&now, &tp->deadline) >= 0) {
+      tp->active = 0;
+      tp->expired = 1;
+    }
   }
-
-  XFlush(disp);
 }
 
-void redraw(void)
+/*
+ * performance counters:
+ * always on and cheap; dumped to stderr on SIGUSR1 and, with -C,
+ * rewritten to a file every StatsInterval seconds.
+ * The signal handler only writes to a self-pipe which the main loop
+ * waits on, so the dump itself never runs in signal context.
+ */
+
+static int stats_pipe[2] = { -1, -1 };
+
+static void stats_sigusr1(int sig)
 {
-  draw_widget();
-  estimate_remain();
-  if (tip_mapped) {
-    tip_format();
-    tip_draw();
+  int saved = errno;
+
+  (void)sig;
+  if (write(stats_pipe[1], "", 1) < 0) {
+    /* pipe full: a dump is pending anyway */
   }
+  errno = saved;
 }
 
 /*
- * tooltip to display status
+ * stats_init:
+ * returns the file descriptor to wait on for dump requests
  */
-
-static int pointer_in_window(Window window)
+static int stats_init(void)
 {
-  Window root_ret, child_ret;
-  int rx, ry, wx, wy;
-  unsigned int mask;
-  XWindowAttributes wa;
+  struct sigaction sa;
 
-  if (window == 0) {
-    return 0;
-  }
-  if (!XGetWindowAttributes(disp, window, &wa)) {
-    return 0;
+  if (pipe(stats_pipe) < 0) {
+    perror("xbattbar: pipe");
+    return -1;
   }
+  fcntl(stats_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(stats_pipe[1], F_SETFL, O_NONBLOCK);
+  fcntl(stats_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(stats_pipe[1], F_SETFD, FD_CLOEXEC);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stats_sigusr1;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
+  return stats_pipe[0];
+}
 
-  if (!XQueryPointer(disp, window, &root_ret, &child_ret,
-    &rx, &ry, &wx, &wy, &mask)) {
-    return 0;
-  }
+/*
+ * stats_pending:
+ * drain the self-pipe; true if a dump was requested
+ */
+static int stats_pending(void)
+{
+  char buf[16];
+  int req = 0;
 
-  return wx >= 0 && wy >= 0 && wx < (int)wa.width && wy < (int)wa.height;
+  while (read(stats_pipe[0], buf, sizeof(buf)) > 0)
+    req = 1;
+  return req;
 }
 
-static int pointer_in_windows(void)
+static void stats_sample_latency(const struct timespec *t0,
+                                 const struct timespec *t1)
 {
-  if (pointer_in_window(win)) {
-    return 1;
-  }
-  if (tip_mapped && pointer_in_window(tip)) {
-    return 1;
+  struct timespec d;
+  unsigned long us;
+  int b = 0;
+
+  timespec_sub((struct timespec *)t1, (struct timespec *)t0, &d);
+  us = (unsigned long)d.tv_sec * 1000000 + d.tv_nsec / 1000;
+  while (us > 0 && b < STATS_HIST - 1) {
+    us >>= 1;
+    b++;
   }
-  return 0;
+  stats.sample_hist[b]++;
 }
 
-static void tip_format(void)
+static void stats_dump(FILE *fp)
 {
-  snprintf(tipmsg, sizeof(tipmsg),
-           "AC %s-line: battery level is %d%%",
-           ac_line ? "on" : "off", battery_level);
+  int i;
+
+  fprintf(fp,
+          "wakeups %lu\n"
+          "wakeups.timer %lu\n"
+          "wakeups.x %lu\n"
+          "wakeups.backend %lu\n"
+          "samples %lu\n"
+          "samples.timeouts %lu\n",
+          stats.wakeups, stats.wakeups_timer, stats.wakeups_x,
+          stats.wakeups_backend, stats.samples, stats.samples_timeout);
+  for (i = 0; i < STATS_HIST; i++) {
+    if (stats.sample_hist[i] == 0)
+      continue;
+    if (i < STATS_HIST - 1)
+      fprintf(fp, "samples.latency_us.<%lu %lu\n",
+              1UL << i, stats.sample_hist[i]);
+    else
+      fprintf(fp, "samples.latency_us.>=%lu %lu\n",
+              1UL << (i - 1), stats.sample_hist[i]);
+  }
+  fprintf(fp,
+          "redraws %lu\n"
+          "redraws.skipped %lu\n"
+          "x.flushes %lu\n"
+          "x.roundtrips %lu\n"
+          "tip.shows %lu\n"
+          "tip.moves %lu\n"
+          "events %lu\n"
+          "events.dropped %lu\n",
+          stats.redraws, stats.redraws_skipped,
+          stats.flushes, stats.roundtrips,
+          stats.tip_shows, stats.tip_moves,
+          stats.events, stats.events_dropped);
+  fflush(fp);
 }
 
-static void tip_ensure_created(void)
+static void stats_write(const char *path)
 {
-  if (tip)
+  char tmp[1024];
+  FILE *fp;
+
+  /* replace the file atomically so readers never see half a dump */
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if ((fp = fopen(tmp, "w")) == NULL) {
+    perror(tmp);
     return;
-  tip = XCreateSimpleWindow(
-          disp, RootWindow(disp, scr),
-          0, 0, 1, 1,               /* pos and size will be updated later */
-          TIP_FRAME_WIDTH,          /* width of frame */
-          pix_fg, pix_bg);
-  XSetWindowAttributes swa;
-  swa.override_redirect = True;     /* exclude from WM */
-  XChangeWindowAttributes(disp, tip, CWOverrideRedirect, &swa);
-  XSelectInput(disp, tip, ExposureMask |
-    EnterWindowMask | LeaveWindowMask | PointerMotionMask);
+  }
+  stats_dump(fp);
+  if (fclose(fp) != 0 || rename(tmp, path) < 0)
+    perror(path);
 }
 
-static void tip_draw(void)
+/*
+ * startup_phase:
+ * charge the time and round trips since the last call to a phase
+ */
+static void startup_phase(int phase)
 {
-  if (!tip_mapped)
-    return;
-
-  XWindowAttributes wa;
-  XGetWindowAttributes(disp, tip, &wa);
-  unsigned int width = wa.width, height = wa.height;
+  struct timespec now, d;
 
-  /* background and frame */
-  XSetForeground(disp, gc_fill, pix_bg);
-  XFillRectangle(disp, tip, gc_fill, 0, 0, width, height);
-  XSetForeground(disp, gc_frame, pix_fg);
-  XDrawRectangle(disp, tip, gc_frame, 0, 0, width - 1, height - 1);
+  if (!startup_trace)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  timespec_sub(&now, &startup_mark, &d);
+  startup_us[phase] += d.tv_sec * 1000000 + d.tv_nsec / 1000;
+  startup_rt[phase] += stats.roundtrips - startup_last_rt;
+  startup_last_rt = stats.roundtrips;
+  startup_mark = now;
+}
 
-  /* status strings */
-  if (fontp != NULL && gc_text != 0) {
-    int ty = (int)tip_pad_y + fontp->ascent;
-    int tx = (int)tip_pad_x;
+static void startup_report(void)
+{
+  struct timespec d;
+  int i;
+
+  timespec_sub(&startup_mark, &startup_start, &d);
+  fprintf(stderr, "xbattbar: first frame after %.3f msec.\n",
+          d.tv_sec * 1e3 + d.tv_nsec / 1e6);
+  for (i = 0; i < STARTUP_PHASES; i++)
+    fprintf(stderr, "xbattbar:   %-12s %9.3f msec. %3lu round trips\n",
+            startup_names[i], startup_us[i] / 1e3, startup_rt[i]);
+}
 
-    XSetForeground(disp, gc_text, pix_fg);
-    XDrawString(disp, tip, gc_text, tx, ty, tipmsg, strlen(tipmsg));
-  }
+/*
+ * status stream:
+ * one JSON object per line for other programs, written to a FIFO,
+ * a Unix socket or a plain file.  Nothing here may block the main
+ * loop: lines wait in a bounded queue while the reader is slow or
+ * gone, the oldest ones are dropped when it is full, and whatever
+ * is left is retried on the next wakeup.  A FIFO without a reader
+ * or a socket nobody listens on is simply opened again later.
+ */
+#define EVENT_QLEN	64		/* lines kept for a slow reader */
+#define EVENT_LINE	192
 
-  XFlush(disp);
-}
+static char event_q[EVENT_QLEN][EVENT_LINE];
+static int event_qlen[EVENT_QLEN];
+static int event_head = 0, event_count = 0;
+static int event_off = 0;		/* bytes of the head line written */
+static int event_fd = -1;
 
-static void tip_show(int root_x, int root_y)
+static void event_connect(void)
 {
-  int tw, th, x, y, sw, sh;
-  unsigned int width, height;
-  int len;
-
-  tip_ensure_created();
-  tip_format();
+  struct stat st;
+  struct sockaddr_un sun;
+  int fd;
 
-  /* Calculate window size */
-  len = strlen(tipmsg);
-  if (fontp != NULL) {
-    tw = XTextWidth(fontp, tipmsg, len);
-    th = fontp->ascent + fontp->descent;
+  if (stat(event_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, event_path, sizeof(sun.sun_path) - 1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+      return;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 &&
+        errno != EINPROGRESS) {
+      close(fd);
+      return;
+    }
   } else {
-    tw = DefaultFontW * len;
-    th = DefaultFontH;
+    /* ENXIO: a FIFO nobody reads yet */
+    fd = open(event_path, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK |
+              O_CLOEXEC, 0644);
+    if (fd < 0)
+      return;
   }
-  width = (unsigned int)(tw + tip_pad_x * 2);
-  height = (unsigned int)(th + tip_pad_y * 2);
+  event_fd = fd;
+  event_off = 0;		/* a new reader gets whole lines only */
+}
 
-  /* Adjust window location */
-  x = root_x + 8;
-  y = root_y - height - (TIP_FRAME_WIDTH * 2 + 2);
-  sw = DisplayWidth(disp, scr);
-  sh = DisplayHeight(disp, scr);
-  if (x + (int)width > sw)
-    x = sw - (int)width;
-  if (y + (int)height > sh)
-    y = sh - (int)height;
-  if (x < 0)
-    x = 0;
-  if (y < 0)
-    y = 0;
+/*
+ * event_flush:
+ * write queued lines until the reader would block
+ */
+static void event_flush(void)
+{
+  ssize_t n;
 
-  XMoveResizeWindow(disp, tip, x, y, width, height);
-  if (!tip_mapped) {
-    XMapRaised(disp, tip);
-    tip_mapped = 1;
+  if (event_count == 0)
+    return;
+  if (event_fd < 0)
+    event_connect();
+  while (event_fd >= 0 && event_count > 0) {
+    n = write(event_fd, event_q[event_head] + event_off,
+              event_qlen[event_head] - event_off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOTCONN) {
+        /* the reader went away */
+        close(event_fd);
+        event_fd = -1;
+      }
+      return;
+    }
+    event_off += n;
+    if (event_off == event_qlen[event_head]) {
+      event_head = (event_head + 1) % EVENT_QLEN;
+      event_count--;
+      event_off = 0;
+    }
   }
-  tip_draw();
 }
 
-static void tip_hide(void)
+static void event_push(const char *fmt, ...)
 {
-  if (!tip)
+  va_list ap;
+  int i, len;
+
+  if (event_path == NULL)
     return;
-  XUnmapWindow(disp, tip);
-  tip_mapped = 0;
+  if (event_count == EVENT_QLEN) {
+    stats.events_dropped++;
+    if (event_off > 0) {
+      /* half written: keep it in place of the next oldest */
+      i = (event_head + 1) % EVENT_QLEN;
+      memcpy(event_q[i], event_q[event_head], event_qlen[event_head]);
+      event_qlen[i] = event_qlen[event_head];
+    }
+    event_head = (event_head + 1) % EVENT_QLEN;
+    event_count--;
+  }
+  i = (event_head + event_count) % EVENT_QLEN;
+  va_start(ap, fmt);
+  len = vsnprintf(event_q[i], EVENT_LINE - 1, fmt, ap);
+  va_end(ap);
+  if (len < 0)
+    return;
+  if (len > EVENT_LINE - 2)
+    len = EVENT_LINE - 2;
+  event_q[i][len++] = '\n';
+  event_qlen[i] = len;
+  event_count++;
+  stats.events++;
+  event_flush();
 }
 
 /*
- * estimating time for battery remaining / charging 
+ * xflush:
+ * flush only if requests have been queued since the last flush
  */
-
-#define CriticalLevel  5
-
-void estimate_remain()
+static void xflush(struct xdisplay *dp)
 {
-  static int battery_base = -1;
-  int diff;
-  int remain;
+  unsigned long req = XNextRequest(dp->disp);
 
-  /* static value initialize */
-  if (battery_base == -1) {
-    battery_base = battery_level;
-    return;
+  if (req != dp->flushed) {
+    XFlush(dp->disp);
+    stats.flushes++;
+    dp->flushed = req;
   }
+}
 
-  diff = battery_base - battery_level;
-
-  if (diff == 0) return;
-
-  /* estimated time for battery remains */
-  if (diff > 0) {
-    remain = elapsed_time * (battery_level - CriticalLevel) / diff ;
-    remain = remain * bi_interval;  /* in sec */
-    if (remain < 0 ) remain = 0;
-    printf("battery remain: %2d hr. %2d min. %2d sec.\n",
-	   remain / 3600, (remain % 3600) / 60, remain % 60);
-    elapsed_time = 0;
-    battery_base = battery_level;
-    return;
+/*
+ * AllocColor:
+ * convert color name to pixel value
+ */
+/*
+ * parse_color:
+ * "#rgb" ... "#rrrrggggbbbb" and "rgb:r/g/b" with 1 to 4 hex digits,
+ * scaled to 16 bits; returns 0 for anything else, e.g. a color name
+ */
+static int parse_color(const char *spec, unsigned short rgb[3])
+{
+  unsigned long v;
+  char *ep;
+  int i, n;
+
+  if (spec[0] == '#') {
+    n = strlen(spec + 1);
+    if (n == 0 || n % 3 != 0 || n > 12 ||
+        strspn(spec + 1, "0123456789abcdefABCDEF") != (size_t)n)
+      return 0;
+    n /= 3;
+    for (i = 0; i < 3; i++) {
+      char buf[5];
+
+      memcpy(buf, spec + 1 + i * n, n);
+      buf[n] = '\0';
+      v = strtoul(buf, NULL, 16);
+      /* #rgb means #r000g000b000, unlike rgb: */
+      rgb[i] = (unsigned short)(v << (16 - 4 * n));
+    }
+    return 1;
   }
-
-  /* estimated time of battery charging */
-  remain = elapsed_time * (battery_level - 100) / diff;
-  remain = remain * bi_interval;  /* in sec */
-  printf("charging remain: %2d hr. %2d min. %2d sec.\n",
-	 remain / 3600, (remain % 3600) / 60, remain % 60);
-  elapsed_time = 0;
-  battery_base = battery_level;
+  if (strncasecmp(spec, "rgb:", 4) != 0)
+    return 0;
+  spec += 4;
+  for (i = 0; i < 3; i++) {
+    v = strtoul(spec, &ep, 16);
+    n = ep - spec;
+    if (n < 1 || n > 4 || *ep != (i < 2 ? '/' : '\0'))
+      return 0;
+    /* scale so that all ones stays all ones */
+    rgb[i] = (unsigned short)(v * 0xffff / ((1UL << (4 * n)) - 1));
+    spec = ep + 1;
+  }
+  return 1;
 }
 
+/* a channel of rgb on a TrueColor visual */
+static unsigned long color_bits(unsigned short v, unsigned long mask)
+{
+  int shift = 0, bits = 0;
 
+  if (mask == 0)
+    return 0;
+  while (!(mask & (1UL << shift)))
+    shift++;
+  while (mask & (1UL << (shift + bits)))
+    bits++;
+  return ((unsigned long)(v >> (16 - bits)) << shift) & mask;
+}
 
-#ifdef __bsdi__
+Status AllocColor(struct widget *wp, char *name, unsigned long *pixel)
+{
+  XColor color,exact;
+  int status;
+  Visual *vis = DefaultVisual(wp->disp, wp->scr);
+  unsigned short rgb[3];
+
+  /* numeric colors on TrueColor need no help from the server */
+  if (vis->class == TrueColor && parse_color(name, rgb)) {
+    *pixel = color_bits(rgb[0], vis->red_mask) |
+      color_bits(rgb[1], vis->green_mask) |
+      color_bits(rgb[2], vis->blue_mask);
+    return 1;
+  }
 
-#include <machine/apm.h>
-#include <machine/apmioctl.h>
+  status = ROUNDTRIP(XAllocNamedColor(wp->disp,
+                                     DefaultColormap(wp->disp, wp->scr),
+                                     name, &color, &exact));
+  *pixel = color.pixel;
 
-int first = 1;
-void battery_check(void)
+  return(status);
+}
+
+#ifdef USE_XCB
+/*
+ * XCBFontStruct:
+ * build an XFontStruct for Xlib's text functions from a QueryFont reply
+ */
+static void XCBCharStruct(XCharStruct *cs, const xcb_charinfo_t *ci)
 {
-  int fd;
-  struct apmreq ar ;
+  cs->lbearing = ci->left_side_bearing;
+  cs->rbearing = ci->right_side_bearing;
+  cs->width = ci->character_width;
+  cs->ascent = ci->ascent;
+  cs->descent = ci->descent;
+  cs->attributes = ci->attributes;
+}
 
-  ++elapsed_time;
+static XFontStruct *XCBFontStruct(xcb_font_t fid, xcb_query_font_reply_t *r)
+{
+  XFontStruct *fs;
+  xcb_charinfo_t *ci;
+  int i, n;
+
+  if ((fs = calloc(1, sizeof(*fs))) == NULL)
+    return NULL;
+  fs->fid = fid;
+  fs->direction = r->draw_direction;
+  fs->min_char_or_byte2 = r->min_char_or_byte2;
+  fs->max_char_or_byte2 = r->max_char_or_byte2;
+  fs->min_byte1 = r->min_byte1;
+  fs->max_byte1 = r->max_byte1;
+  fs->all_chars_exist = r->all_chars_exist;
+  fs->default_char = r->default_char;
+  fs->ascent = r->font_ascent;
+  fs->descent = r->font_descent;
+  XCBCharStruct(&fs->min_bounds, &r->min_bounds);
+  XCBCharStruct(&fs->max_bounds, &r->max_bounds);
+
+  n = xcb_query_font_char_infos_length(r);
+  ci = xcb_query_font_char_infos(r);
+  if (n > 0 && (fs->per_char = calloc(n, sizeof(XCharStruct))) != NULL) {
+    for (i = 0; i < n; i++)
+      XCBCharStruct(&fs->per_char[i], &ci[i]);
+  }
+  return fs;
+}
 
-  ar.func = APM_GET_POWER_STATUS ;
-  ar.dev = APM_DEV_ALL ;
+/*
+ * XCBLoadQueryFont:
+ * the OpenFont/QueryFont pair of XLoadQueryFont() as cookies
+ */
+static xcb_query_font_cookie_t XCBLoadQueryFont(xcb_connection_t *c,
+                                                const char *name,
+                                                xcb_font_t *fidp,
+                                                xcb_void_cookie_t *ocp)
+{
+  *fidp = xcb_generate_id(c);
+  *ocp = xcb_open_font_checked(c, *fidp, strlen(name), name);
+  return xcb_query_font(c, *fidp);
+}
 
-  if ((fd = open(_PATH_DEVAPM, O_RDONLY)) < 0) {
-    perror(_PATH_DEVAPM) ;
-    exit(1) ;
-  }
-  if (ioctl(fd, PIOCAPMREQ, &ar) < 0) {
-    fprintf(stderr, "xbattbar: PIOCAPMREQ: APM_GET_POWER_STATUS error 0x%x\n", ar.err);
+static XFontStruct *XCBLoadQueryFontReply(xcb_connection_t *c,
+                                          xcb_font_t fid,
+                                          xcb_void_cookie_t oc,
+                                          xcb_query_font_cookie_t qc)
+{
+  xcb_generic_error_t *e;
+  xcb_query_font_reply_t *r;
+  XFontStruct *fs = NULL;
+
+  if ((e = xcb_request_check(c, oc)) != NULL) {
+    free(e);
+    xcb_discard_reply(c, qc.sequence);
+    return NULL;
   }
-  close (fd);
-
-  if (first || ac_line != ((ar.bret >> 8) & 0xff)
-      || battery_level != (ar.cret&0xff)) {
-    first = 0;
-    ac_line = (ar.bret >> 8) & 0xff;
-    battery_level = ar.cret&0xff;
-    redraw();
+  if ((r = xcb_query_font_reply(c, qc, NULL)) != NULL) {
+    fs = XCBFontStruct(fid, r);
+    free(r);
   }
+  return fs;
 }
 
-#endif /* __bsdi__ */
+/*
+ * InitResourcesXCB:
+ * pipeline the color, font and atom requests and only then
+ * collect the replies, which costs one round trip instead of seven;
+ * the font and the atoms are only needed once per display
+ */
+static void InitResourcesXCB(struct widget *wp)
+{
+  struct xdisplay *dp = wp->dp;
+  xcb_connection_t *c = XGetXCBConnection(wp->disp);
+  xcb_colormap_t cmap = DefaultColormap(wp->disp, wp->scr);
+  Visual *vis = DefaultVisual(wp->disp, wp->scr);
+  char *names[4];
+  unsigned short rgb[3];
+  int how[4];			/* COLOR_* below */
+  unsigned long *pixels[4];
+  static const char *atoms[2] = { "WM_DELETE_WINDOW", "WM_PROTOCOLS" };
+  xcb_alloc_named_color_cookie_t cc[4];
+  xcb_alloc_color_cookie_t nc[4];
+  xcb_intern_atom_cookie_t ac[2];
+  xcb_query_font_cookie_t qc;
+  xcb_void_cookie_t oc;
+  xcb_font_t fid;
+  int i, ok = 1, first = !dp->font_tried;
+
+  names[0] = ONIN_C;  pixels[0] = &wp->onin;
+  names[1] = OFFOUT_C; pixels[1] = &wp->offout;
+  names[2] = OFFIN_C; pixels[2] = &wp->offin;
+  names[3] = ONOUT_C; pixels[3] = &wp->onout;
 
-#ifdef __FreeBSD__
+  /*
+   * AllocNamedColor only knows names; "#rrggbb" and "rgb:r/g/b" are
+   * parsed here as XAllocNamedColor() would, and on TrueColor need
+   * no request at all
+   */
+#define COLOR_DONE	0
+#define COLOR_RGB	1
+#define COLOR_NAMED	2
+  for (i = 0; i < 4; i++) {
+    if (!parse_color(names[i], rgb)) {
+      how[i] = COLOR_NAMED;
+      cc[i] = xcb_alloc_named_color(c, cmap, strlen(names[i]), names[i]);
+    } else if (vis->class == TrueColor) {
+      how[i] = COLOR_DONE;
+      *pixels[i] = color_bits(rgb[0], vis->red_mask) |
+        color_bits(rgb[1], vis->green_mask) |
+        color_bits(rgb[2], vis->blue_mask);
+    } else {
+      how[i] = COLOR_RGB;
+      nc[i] = xcb_alloc_color(c, cmap, rgb[0], rgb[1], rgb[2]);
+    }
+  }
+  if (first) {
+    qc = XCBLoadQueryFont(c, font_name, &fid, &oc);
+    for (i = 0; i < 2; i++)
+      ac[i] = xcb_intern_atom(c, 0, strlen(atoms[i]), atoms[i]);
+  }
 
-#include <machine/apm_bios.h>
+  /* all of the replies arrive after a single round trip */
+  stats.roundtrips++;
+  for (i = 0; i < 4; i++) {
+    if (how[i] == COLOR_NAMED) {
+      xcb_alloc_named_color_reply_t *r;
 
-#define APMDEV21       "/dev/apm0"
-#define APMDEV22       "/dev/apm"
+      if ((r = xcb_alloc_named_color_reply(c, cc[i], NULL)) == NULL) {
+        ok = 0;
+        continue;
+      }
+      *pixels[i] = r->pixel;
+      free(r);
+    } else if (how[i] == COLOR_RGB) {
+      xcb_alloc_color_reply_t *r;
 
-#define        APM_STAT_UNKNOWN        255
+      if ((r = xcb_alloc_color_reply(c, nc[i], NULL)) == NULL) {
+        ok = 0;
+        continue;
+      }
+      *pixels[i] = r->pixel;
+      free(r);
+    }
+  }
+#undef COLOR_DONE
+#undef COLOR_RGB
+#undef COLOR_NAMED
+  if (first) {
+    dp->fontp = XCBLoadQueryFontReply(c, fid, oc, qc);
+    for (i = 0; i < 2; i++) {
+      xcb_intern_atom_reply_t *r;
+      Atom a = None;
+
+      if ((r = xcb_intern_atom_reply(c, ac[i], NULL)) != NULL) {
+        a = r->atom;
+        free(r);
+      }
+      if (i == 0)
+        dp->wm_delete_window = a;
+      else
+        dp->wm_protocols = a;
+    }
+  }
 
-#define        APM_STAT_LINE_OFF       0
-#define        APM_STAT_LINE_ON        1
+  if (!ok) {
+    fprintf(stderr, "xbattbar: can't allocate color resources\n");
+    exit(EXIT_FAILURE);
+  }
+  if (first && dp->fontp == NULL) {
+    qc = XCBLoadQueryFont(c, "fixed", &fid, &oc);
+    stats.roundtrips++;
+    dp->fontp = XCBLoadQueryFontReply(c, fid, oc, qc);
+  }
+  dp->font_tried = 1;
+  wp->fontp = dp->fontp;
+  if (wp->fontp != NULL) {
+    XGCValues gv = {0};
 
-#define        APM_STAT_BATT_HIGH      0
-#define        APM_STAT_BATT_LOW       1
-#define        APM_STAT_BATT_CRITICAL  2
-#define        APM_STAT_BATT_CHARGING  3
+    gv.font = wp->fontp->fid;
+    wp->gc_text = XCreateGC(wp->disp, RootWindow(wp->disp, wp->scr),
+                            GCFont, &gv);
+  }
+}
+#endif /* USE_XCB */
 
-int first = 1;
-void battery_check(void)
+/*
+ * InitDisplay:
+ * connect to a display; NULL for $DISPLAY
+ */
+struct xdisplay *InitDisplay(const char *name)
 {
-  int fd, r, p;
-  struct apm_info     info;
+  struct xdisplay *dp = &displays[ndisplays];
 
-  if ((fd = open(APMDEV21, O_RDWR)) == -1 &&
-      (fd = open(APMDEV22, O_RDWR)) == -1) {
-    fprintf(stderr, "xbattbar: cannot open apm device\n");
-    exit(1);
+  if((dp->disp = XOpenDisplay(name)) == NULL) {
+      fprintf(stderr, "xbattbar: can't open display %s.\n",
+              XDisplayName(name));
+      exit(1);
   }
-  if (ioctl(fd, APMIO_GETINFO, &info) == -1) {
-    fprintf(stderr, "xbattbar: ioctl APMIO_GETINFO failed\n");
-    exit(1);
+  ndisplays++;
+  dp->fontp = NULL;
+  dp->font_tried = 0;
+  dp->flushed = 0;
+  startup_phase(STARTUP_CONNECT);
+
+#ifndef USE_XCB
+  {
+    static char *names[2] = { "WM_DELETE_WINDOW", "WM_PROTOCOLS" };
+    Atom atoms[2];
+
+    /* both in one round trip; the font waits until it is drawn with */
+    if (!ROUNDTRIP(XInternAtoms(dp->disp, names, 2, False, atoms)))
+      atoms[0] = atoms[1] = None;
+    dp->wm_delete_window = atoms[0];
+    dp->wm_protocols = atoms[1];
   }
-  close (fd);
-
-  ++elapsed_time;
+  startup_phase(STARTUP_RESOURCES);
+#endif
+  return dp;
+}
 
-  /* get current status */
-  if (info.ai_batt_life == APM_STAT_UNKNOWN) {
-    switch (info.ai_batt_stat) {
-    case APM_STAT_BATT_HIGH:
-      r = 100;
-      break;
-    case APM_STAT_BATT_LOW:
-      r = 40;
-      break;
-    case APM_STAT_BATT_CRITICAL:
-      r = 10;
-      break;
-    default:        /* expected to be APM_STAT_UNKNOWN */
-      r = 100;
-    }
-  } else if (info.ai_batt_life > 100) {
-    /* some APM BIOSes return values slightly > 100 */
-    r = 100;
-  } else {
-    r = info.ai_batt_life;
+/*
+ * widget_font:
+ * the font of the widget, loaded with its metrics the first time
+ * any widget on the display needs it; NULL if there is none
+ */
+static XFontStruct *widget_font(struct widget *wp)
+{
+  struct xdisplay *dp = wp->dp;
+
+  if (wp->fontp != NULL)
+    return wp->fontp;
+  if (!dp->font_tried) {
+    dp->font_tried = 1;
+    dp->fontp = ROUNDTRIP(XLoadQueryFont(dp->disp, font_name));
+    if (dp->fontp == NULL)
+      dp->fontp = ROUNDTRIP(XLoadQueryFont(dp->disp, "fixed"));
   }
+  if ((wp->fontp = dp->fontp) != NULL) {
+    XGCValues gv = {0};
 
-  /* get AC-line status */
-  if (info.ai_acline == APM_STAT_LINE_ON) {
-    p = APM_STAT_LINE_ON;
-  } else {
-    p = APM_STAT_LINE_OFF;
+    gv.font = wp->fontp->fid;
+    wp->gc_text = XCreateGC(wp->disp, wp->win, GCFont, &gv);
   }
+  return wp->fontp;
+}
 
-  if (first || ac_line != p || battery_level != r) {
-    first = 0;
-    ac_line = p;
-    battery_level = r;
-    redraw();
+/*
+ * InitWidget:
+ * create a window for WM Swallow on a screen of the display
+ */
+void InitWidget(struct xdisplay *dp, int scr)
+{
+  struct widget *wp = &widgets[nwidgets++];
+  Display *disp = dp->disp;
+
+  wp->dp = dp;
+  wp->disp = disp;
+  wp->scr = scr;
+  wp->pix_bg = WhitePixel(disp, scr);
+  wp->pix_fg = BlackPixel(disp, scr);
+  wp->win_w = win_w;
+  wp->win_h = win_h;
+  wp->tip_w = wp->tip_h = 1;
+  wp->tip_timer = -1;
+
+#ifdef USE_XCB
+  InitResourcesXCB(wp);
+#else
+  if (!AllocColor(wp, ONIN_C, &wp->onin) ||
+       !AllocColor(wp, OFFOUT_C, &wp->offout) ||
+       !AllocColor(wp, OFFIN_C, &wp->offin) ||
+       !AllocColor(wp, ONOUT_C, &wp->onout)) {
+    fprintf(stderr, "xbattbar: can't allocate color resources\n");
+    exit(EXIT_FAILURE);
   }
-}
+#endif
+  startup_phase(STARTUP_RESOURCES);
 
-#endif /* __FreeBSD__ */
+  XSetWindowAttributes attr = {0};
+  attr.background_pixmap = None;	/* exposures are repaired from win_pix */
+  attr.event_mask = ExposureMask | StructureNotifyMask |
+    VisibilityChangeMask |
+    EnterWindowMask | LeaveWindowMask | PointerMotionMask;
 
-#ifdef __NetBSD__
+  wp->win = XCreateWindow(disp, RootWindow(disp, scr),
+                      have_x ? win_x : 0, have_y ? win_y : 0,
+                      win_w, win_h,
+                      0,
+                      DefaultDepth(disp, scr),
+                      InputOutput,
+                      DefaultVisual(disp, scr),
+                      CWBackPixmap | CWEventMask,
+                      &attr
+    );
 
-#ifndef _NO_APM
-#include <machine/apmvar.h>
-#else
-#define APM_AC_OFF	0x00
-#define APM_AC_ON	0x01
-#endif
+  /* set WM_NAME / CLASS for WM Swallow */
+  XStoreName(disp, wp->win, wm_name);
+  XClassHint ch;
+  ch.res_name  = wm_name;
+  ch.res_class = (char *)"Xbattbar";
+  XSetClassHint(disp, wp->win, &ch);
 
-#define _PATH_APM_SOCKET       "/var/run/apmdev"
-#define _PATH_APM_CTLDEV       "/dev/apmctl"
-#define _PATH_APM_NORMAL       "/dev/apm"
+  /* copies from win_pix never leave holes, don't ask for NoExpose */
+  XGCValues gv = {0};
+  gv.graphics_exposures = False;
+  wp->gc_fill  = XCreateGC(disp, wp->win, GCGraphicsExposures, &gv);
+  wp->gc_frame = XCreateGC(disp, wp->win, GCGraphicsExposures, &gv);
+
+  XSetWMProtocols(disp, wp->win, &dp->wm_delete_window, 1);
+  XMapWindow(disp, wp->win);
+  startup_phase(STARTUP_WINDOW);
+}
 
 /*
- * pre:  fd contains a valid file descriptor of an envsys(4) supporting device
- *       && ns is the number of sensors
- *       && etds and ebis are arrays of sufficient size
- * post: returns 0 and etds and ebis arrays are filled with sensor info
- *       or returns -1 on failure
+ * find the widget an event is for
  */
-static int
-fillsensors(int fd, envsys_tre_data_t *etds, envsys_basic_info_t *ebis,
-    size_t ns)
+static struct widget *widget_of(struct xdisplay *dp, Window w)
 {
-	int i;
+  int i;
 
-	for (i = 0; i < ns; ++i) {
-		ebis[i].sensor = i;
-		if (ioctl(fd, ENVSYS_GTREINFO, &ebis[i]) == -1) {
-			warn("Can't get sensor info for sensor %d", i);
-			return 0;
-		}
+  for (i = 0; i < nwidgets; i++) {
+    struct widget *wp = &widgets[i];
 
-		etds[i].sensor = i;
-		if (ioctl(fd, ENVSYS_GTREDATA, &etds[i]) == -1) {
-			warn("Can't get sensor data for sensor %d", i);
-			return 0;
-		}
-	}
-	return 1;
+    if (wp->dp == dp && !wp->closed && (wp->win == w || wp->tip == w))
+      return wp;
+  }
+  return NULL;
 }
 
 /*
- * pre:  fd contains a valid file descriptor of an envsys(4) supporting device
- * post: returns the number of valid sensors provided by the device
- *       or -1 on error
+ * widget_close:
+ * the window manager asked to delete the widget;
+ * returns the number of widgets left
+ */
+static int widget_close(struct widget *wp)
+{
+  int i, n = 0;
+
+  if (wp->tip)
+    XDestroyWindow(wp->disp, wp->tip);
+  XDestroyWindow(wp->disp, wp->win);
+  sched_timer_cancel(wp->tip_timer);
+  wp->closed = 1;
+  wp->damage = 0;
+  for (i = 0; i < nwidgets; i++)
+    if (!widgets[i].closed)
+      n++;
+  return n;
+}
+
+/*
+ * handle_event:
+ * returns the number of widgets still open
+ */
+static int handle_event(struct xdisplay *dp, XEvent *ev)
+{
+  struct widget *wp = widget_of(dp, ev->xany.window);
+
+  if (wp == NULL)
+    return 1;
+
+  switch (ev->type) {
+  case Expose:
+    if (ev->xexpose.window == wp->win) {
+      damage_expose(wp, &ev->xexpose);
+    } else {
+      wp->damage |= DAMAGE_TIP;
+    }
+    break;
+  case ConfigureNotify:
+    /* a pure move needs no repaint */
+    if (ev->xconfigure.window == wp->win &&
+        ((unsigned int)ev->xconfigure.width != wp->win_w ||
+         (unsigned int)ev->xconfigure.height != wp->win_h)) {
+      wp->win_w = ev->xconfigure.width;
+      wp->win_h = ev->xconfigure.height;
+      wp->damage |= DAMAGE_SIZE;
+    } else {
+      stats.redraws_skipped++;
+    }
+    break;
+
+  case MapNotify:
+    if (ev->xmap.window == wp->win)
+      wp->mapped = 1;
+    break;
+  case UnmapNotify:
+    /* iconified, or on another desktop */
+    if (ev->xunmap.window == wp->win)
+      wp->mapped = 0;
+    break;
+  case VisibilityNotify:
+    if (ev->xvisibility.window == wp->win)
+      wp->obscured = ev->xvisibility.state == VisibilityFullyObscured;
+    break;
+
+  case EnterNotify:
+    if (ev->xcrossing.window == wp->tip) {
+      wp->in_tip = 1;
+    }
+    if (ev->xcrossing.window == wp->win) {
+      struct timespec tip_disp;
+
+      wp->in_win = 1;
+      wp->tip_hovering = 1;
+      clock_gettime(CLOCK_MONOTONIC, &tip_disp);
+      timespec_add_msec(&tip_disp, tip_delay_ms);
+      if (!wp->tip_mapped) {
+        sched_timer_set(wp->tip_timer, &tip_disp, 0);
+      }
+      wp->tip_xroot = ev->xcrossing.x_root;
+      wp->tip_yroot = ev->xcrossing.y_root;
+    }
+    break;
+  case LeaveNotify:
+    /*
+     * The pointer may be crossing between the widget and the tooltip;
+     * decide after the matching EnterNotify has been seen.
+     */
+    if (ev->xcrossing.window == wp->win) {
+      wp->in_win = 0;
+      wp->tip_hovering = 0;
+      sched_timer_cancel(wp->tip_timer);
+      wp->left = 1;
+    } else if (ev->xcrossing.window == wp->tip) {
+      wp->in_tip = 0;
+      wp->left = 1;
+    }
+    break;
+  case MotionNotify:
+    /* only the last position of a burst is acted upon, in redraw() */
+    wp->tip_xroot = ev->xmotion.x_root;
+    wp->tip_yroot = ev->xmotion.y_root;
+    if (wp->tip_mapped) {
+      wp->damage |= DAMAGE_MOVE;
+    }
+    break;
+
+  case ClientMessage:
+    if (ev->xclient.message_type == dp->wm_protocols &&
+        (Atom)ev->xclient.data.l[0] == dp->wm_delete_window) {
+      return widget_close(wp);
+    }
+  }
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  int ch;
+  char *geom = NULL;
+  struct timespec next;
+  int i, bfd;
+  int poll_timer, stats_timer = -1, sfd;
+  int sampler_timer = -1, smfd = -1;
+  int visible = 0;
+  char *stats_file = NULL;
+  char *backend_name = NULL;
+  char *record_file = NULL;
+  char *publish_file = NULL;
+
+  clock_gettime(CLOCK_MONOTONIC, &startup_start);
+  startup_mark = startup_start;
+  about_this_program();
+  while ((ch = getopt(argc, argv, "A:B:C:D:dE:fg:F:HhI:i:Kk:m:O:o:P:p:q:R:r:S:s:Tuvw:x")) != -1)
+    switch (ch) {
+    case 'I':
+      ONIN_C = optarg;
+      break;
+    case 'i':
+      OFFIN_C = optarg;
+      break;
+    case 'O':
+      ONOUT_C = optarg;
+      break;
+    case 'o':
+      OFFOUT_C = optarg;
+      break;
+
+    case 'F':
+      font_name = optarg;
+      break;
+
+    case 'g':
+      geom = optarg;
+      break;
+
+    case 'D':
+      if (ndisplay_names < MAX_DISPLAYS)
+        display_names[ndisplay_names++] = optarg;
+      break;
+
+    case 'x':
+      all_screens = True;
+      break;
+
+    case 'H':
+      history_mode = True;
+      break;
+
+    case 'p':
+      bi_interval = atoi(optarg);
+      break;
+
+    case 'P':
+      bi_interval_max = atoi(optarg);
+      break;
+
+    case 'q':
+      bi_interval_hidden = atoi(optarg);
+      break;
+
+    case 'A':
+      timer_slack = atoi(optarg);
+      break;
+
+    case 'w':
+      sample_timeout = atoi(optarg);
+      break;
+
+    case 'B':
+      backend_name = optarg;
+      break;
+
+    case 'R':
+      record_file = optarg;
+      break;
+
+    case 'r':
+      replay_file = optarg;
+      backend_name = "replay";
+      break;
+
+    case 'f':
+      replay_fast = True;
+      break;
+
+    case 'S':
+      publish_file = optarg;
+      break;
+
+    case 'k':
+      persist_path = optarg;
+      break;
+
+    case 'K':
+      persist_off = True;
+      break;
+
+    case 'm':
+      shm_file = optarg;
+      backend_name = "shm";
+      break;
+
+#ifdef linux
+    case 's':
+      sysfs_root = optarg;
+      break;
+
+    case 'u':
+      use_uevent = True;
+      break;
+#endif
+
+    case 'd':
+      debug = True;
+      break;
+
+    case 'T':
+      startup_trace = True;
+      break;
+
+    case 'C':
+      stats_file = optarg;
+      break;
+
+    case 'E':
+      event_path = optarg;
+      break;
+
+    case 'h':
+    case 'v':
+      usage(argv);
+      break;
+    }
+
+  if (geom) {
+    int x, y;
+    unsigned int w, h;
+    int flags = XParseGeometry(geom, &x, &y, &w, &h);
+    if (flags & WidthValue) {
+      win_w = w;
+    }
+    if (flags & HeightValue) {
+      win_h = h;
+    }
+    if (flags & XValue) {
+      have_x = 1;
+      win_x = x;
+    }
+    if (flags & YValue) {
+      have_y = 1;
+      win_y = y;
+    }
+  }
+
+  /*
+   * X Window main loop
+   */
+  if (event_path) {
+    /* a reader going away must not kill us */
+    signal(SIGPIPE, SIG_IGN);
+  }
+  if (record_file)
+    record_open(record_file);
+  backend_open(backend_name);
+  if (publish_file)
+    shm_publish_open(publish_file);
+  if (!persist_off && replay_file == NULL && shm_file == NULL) {
+    /* replays and borrowed samples are not ours to keep */
+    persist_open(persist_path);
+    persist_load();
+  }
+  startup_phase(STARTUP_BACKEND);
+  bfd = backend_fd();
+  if (bfd >= 0 && bi_interval < EventPollingInterval) {
+    /* polling is only a safety net for event driven backends */
+    bi_interval = EventPollingInterval;
+  }
+  if (bi_interval_max > 0 && bi_interval_max < bi_interval) {
+    bi_interval_max = bi_interval;
+  }
+  if (ndisplay_names == 0)
+    display_names[ndisplay_names++] = NULL;
+  for (i = 0; i < ndisplay_names; i++) {
+    struct xdisplay *dp = InitDisplay(display_names[i]);
+    int scr;
+
+    if (!all_screens) {
+      InitWidget(dp, DefaultScreen(dp->disp));
+      continue;
+    }
+    for (scr = 0; scr < ScreenCount(dp->disp) && nwidgets < MAX_WIDGETS;
+         scr++)
+      InitWidget(dp, scr);
+  }
+  battery_check();
+  startup_phase(STARTUP_SAMPLE);
+  if (debug) {
+    fprintf(stderr, "xbattbar: startup: %lu X round trips\n",
+            stats.roundtrips);
+  }
+
+  sched_init();
+  for (i = 0; i < ndisplays; i++)
+    sched_add_fd(ConnectionNumber(displays[i].disp));
+  if (sample_timeout > 0) {
+    /* the thread takes over the backend and its fd */
+    smfd = sampler_start();
+    sched_add_fd(smfd);
+    sampler_timer = sched_timer_new();
+    bfd = -1;
+  }
+  if (bfd >= 0)
+    sched_add_fd(bfd);
+  if ((sfd = stats_init()) >= 0)
+    sched_add_fd(sfd);
+  poll_timer = sched_timer_new();
+  for (i = 0; i < nwidgets; i++)
+    widgets[i].tip_timer = sched_timer_new();
+  if (stats_file) {
+    stats_timer = sched_timer_new();
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    timespec_add_msec(&next, (time_t)StatsInterval * 1000);
+    sched_timer_set(stats_timer, &next, timer_slack);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  timespec_add_msec(&next, (time_t)poll_interval() * 1000);
+  sched_timer_set(poll_timer, &next, timer_slack);
+
+  while (1) {
+    struct timespec now;
+    int queued = 0;
+
+    /*
+     * one repaint and one flush for everything done since last time;
+     * a widget nobody can see keeps its damage until it is shown
+     */
+    for (i = 0; i < nwidgets; i++) {
+      struct widget *wp = &widgets[i];
+
+      if (wp->damage && wp->mapped && !wp->obscured) {
+        redraw(wp);
+      }
+    }
+    if (startup_trace && stats.redraws > 0) {
+      /* the frame is only there once the server has drawn it */
+      for (i = 0; i < ndisplays; i++)
+        XSync(displays[i].disp, False);
+      startup_phase(STARTUP_FRAME);
+      startup_report();
+      startup_trace = False;
+    }
+    for (i = 0; i < ndisplays; i++) {
+      xflush(&displays[i]);
+      /* events may have been read in already while waiting for a reply */
+      if (XEventsQueued(displays[i].disp, QueuedAlready) > 0)
+        queued = 1;
+    }
+
+    sched_wait(queued);
+    stats.wakeups++;
+    event_flush();
+
+    if (sfd >= 0 && sched_fd_ready(sfd) && stats_pending()) {
+      stats_dump(stderr);
+    }
+    if (stats_timer >= 0 && sched_timer_expired(stats_timer)) {
+      stats_write(stats_file);
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      timespec_add_msec(&now, (time_t)StatsInterval * 1000);
+      sched_timer_set(stats_timer, &now, timer_slack);
+    }
+
+    for (i = 0; i < ndisplays; i++) {
+      struct xdisplay *dp = &displays[i];
+      int j;
+
+      if (XEventsQueued(dp->disp, QueuedAlready) == 0 &&
+          !sched_fd_ready(ConnectionNumber(dp->disp)))
+        continue;
+      stats.wakeups_x++;
+      while (XPending(dp->disp) > 0) {
+        XNextEvent(dp->disp, &theEvent);
+        if (handle_event(dp, &theEvent) == 0)
+          goto out;		/* the last widget has been closed */
+      }
+      for (j = 0; j < nwidgets; j++) {
+        struct widget *wp = &widgets[j];
+
+        if (wp->dp == dp && wp->left && !pointer_in_windows(wp)) {
+          tip_hide(wp);
+        }
+        wp->left = 0;
+      }
+    }
+    if (bi_interval_hidden > bi_interval) {
+      int v = widgets_visible();
+
+      if (v && !visible) {
+        /* shown again: sample now rather than at the hidden pace */
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        sched_timer_set(poll_timer, &next, 0);
+      }
+      visible = v;
+    }
+    if (smfd >= 0 && sched_fd_ready(smfd)) {
+      switch (sampler_collect()) {
+      case 2:			/* from a backend event */
+        stats.wakeups_backend++;
+        /* FALLTHROUGH */
+      case 1:
+        /* restart the poll with the interval this sample led to */
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        timespec_add_msec(&next, (time_t)poll_interval() * 1000);
+        sched_timer_set(poll_timer, &next, timer_slack);
+        sched_timer_cancel(sampler_timer);
+        break;
+      }
+    }
+    if (sampler_timer >= 0 && sched_timer_expired(sampler_timer)) {
+      /* stuck in the hardware: keep showing the last good sample */
+      stats.samples_timeout++;
+      event_push("{\"event\":\"timeout\",\"time\":%ld,\"msec\":%d}",
+                 (long)time(NULL), sample_timeout);
+      if (debug)
+        fprintf(stderr, "xbattbar: no sample within %d msec.\n",
+                sample_timeout);
+    }
+    if (bfd >= 0 && sched_fd_ready(bfd) && backend_pending()) {
+      /* backend reported a change: sample now and restart the poll */
+      stats.wakeups_backend++;
+      battery_check();
+      clock_gettime(CLOCK_MONOTONIC, &next);
+      timespec_add_msec(&next, (time_t)poll_interval() * 1000);
+      sched_timer_set(poll_timer, &next, timer_slack);
+    }
+    if (sched_timer_expired(poll_timer)) {
+      time_t iv;
+
+      stats.wakeups_timer++;
+      if (sampler_timer >= 0) {
+        if (!sched_timers[sampler_timer].active) {
+          clock_gettime(CLOCK_MONOTONIC, &now);
+          timespec_add_msec(&now, sample_timeout);
+          sched_timer_set(sampler_timer, &now, 0);
+        }
+        /* backs off in sampler_collect(), once the sample is in */
+        sampler_request();
+      } else {
+        battery_check();
+        poll_update();
+      }
+      iv = (time_t)poll_interval() * 1000;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      timespec_add_msec(&next, iv);
+      if (timespec_cmp(&now, &next) >= 0) {
+        /* overslept: start over from now */
+        next = now;
+        timespec_add_msec(&next, iv);
+      }
+      sched_timer_set(poll_timer, &next, timer_slack);
+    }
+    for (i = 0; i < nwidgets; i++) {
+      struct widget *wp = &widgets[i];
+
+      if (sched_timer_expired(wp->tip_timer)) {
+        stats.wakeups_timer++;
+        if (wp->tip_hovering && !wp->tip_mapped) {
+          tip_show(wp, wp->tip_xroot, wp->tip_yroot);
+        }
+      }
+    }
+  }
+
+ out:
+  if (stats_file)
+    stats_write(stats_file);
+  event_flush();
+  if (smfd < 0) {
+    /* else the sampler may be stuck in there, exit() is enough */
+    backend_close();
+  }
+  exit(EXIT_SUCCESS);
+}
+
+/*
+ * percentage labels:
+ * each "NN%" is measured and drawn once, with its shadow, into a pixmap
+ * and a clip mask; a frame then only needs one masked CopyArea.
+ * The cache is flushed when the font changes.
+ */
+static void label_flush(struct widget *wp)
+{
+  int i;
+
+  for (i = 0; i < LABEL_MAX; i++) {
+    if (wp->labels[i].pix != None) {
+      XFreePixmap(wp->disp, wp->labels[i].pix);
+      XFreePixmap(wp->disp, wp->labels[i].mask);
+      wp->labels[i].pix = wp->labels[i].mask = None;
+    }
+    wp->labels[i].valid = 0;
+  }
+  wp->label_font = None;
+}
+
+static struct label *label_get(struct widget *wp, unsigned int pct)
+{
+  struct label *lp = &wp->labels[pct];
+  char buf[8];
+  int len, dir, ascent, descent;
+  XCharStruct cs;
+  GC gc_mask;
+  XGCValues gv;
+
+  if (wp->label_font != wp->fontp->fid)
+    label_flush(wp);
+  if (lp->valid)
+    return lp;
+
+  wp->label_font = wp->fontp->fid;
+  lp->valid = 1;
+  len = snprintf(buf, sizeof(buf), "%u%%", pct);
+  XTextExtents(wp->fontp, buf, len, &dir, &ascent, &descent, &cs);
+  lp->tw = cs.width;
+  lp->x = cs.lbearing < 0 ? -cs.lbearing : 0;	/* origin in the label */
+  lp->y = wp->fontp->ascent;
+  lp->w = lp->x + (cs.rbearing > cs.width ? cs.rbearing : cs.width) + 1;
+  lp->h = wp->fontp->ascent + wp->fontp->descent + 1;	/* +1 for the shadow */
+  if (lp->w <= 1 || lp->h <= 1)
+    return lp;
+
+  lp->pix = XCreatePixmap(wp->disp, wp->win, lp->w, lp->h, DefaultDepth(wp->disp, wp->scr));
+  lp->mask = XCreatePixmap(wp->disp, wp->win, lp->w, lp->h, 1);
+
+  /* text in pix_fg over its shadow in pix_bg */
+  XSetForeground(wp->disp, wp->gc_text, wp->pix_bg);
+  XFillRectangle(wp->disp, lp->pix, wp->gc_text, 0, 0, lp->w, lp->h);
+  XSetForeground(wp->disp, wp->gc_text, wp->pix_fg);
+  XDrawString(wp->disp, lp->pix, wp->gc_text, lp->x, lp->y, buf, len);
+
+  /* mask covers both the text and the shadow */
+  gv.font = wp->fontp->fid;
+  gv.foreground = 0;
+  gc_mask = XCreateGC(wp->disp, lp->mask, GCFont | GCForeground, &gv);
+  XFillRectangle(wp->disp, lp->mask, gc_mask, 0, 0, lp->w, lp->h);
+  XSetForeground(wp->disp, gc_mask, 1);
+  XDrawString(wp->disp, lp->mask, gc_mask, lp->x + 1, lp->y + 1, buf, len);
+  XDrawString(wp->disp, lp->mask, gc_mask, lp->x, lp->y, buf, len);
+  XFreeGC(wp->disp, gc_mask);
+
+  if (wp->gc_label == 0) {
+    gv.graphics_exposures = False;
+    wp->gc_label = XCreateGC(wp->disp, wp->win, GCGraphicsExposures, &gv);
+  }
+  return lp;
+}
+
+/*
+ * draw_label:
+ * the capacity percentage, centered on a drawable
+ */
+static void draw_label(struct widget *wp, Drawable d, unsigned int pct)
+{
+  struct label *lp;
+  int tx, ty;
+
+  if (widget_font(wp) == NULL)
+    return;
+  lp = label_get(wp, pct);
+  tx = (int)(wp->win_w - lp->tw) / 2 - lp->x;
+  ty = (int)(wp->win_h + wp->fontp->ascent - wp->fontp->descent) / 2 - lp->y;
+  if (lp->pix != None) {
+    XSetClipMask(wp->disp, wp->gc_label, lp->mask);
+    XSetClipOrigin(wp->disp, wp->gc_label, tx, ty);
+    XCopyArea(wp->disp, lp->pix, d, wp->gc_label, 0, 0, lp->w, lp->h, tx, ty);
+  }
+}
+
+/*
+ * render_widget:
+ * paint the widget into its off-screen pixmap
+ */
+static void render_widget(struct widget *wp)
+{
+  unsigned int width, height, margin, bx, by, bw, bh, fill_w;
+  unsigned int pct;
+  unsigned long col_in, col_out;
+
+  width = wp->win_w;
+  height = wp->win_h;
+
+  /* background (white) */
+  XSetForeground(wp->disp, wp->gc_fill, wp->pix_bg);
+  XFillRectangle(wp->disp, wp->win_pix, wp->gc_fill, 0, 0, width, height);
+
+  /* frame (black) */
+  margin = (width < 32 || height < 12) ? 1u : 2u;
+  bx = by = margin;
+  bw = (width > margin * 2U) ? (width - margin * 2U) : width;
+  bh = (height > margin * 2U) ? (height - margin * 2U) : height;
+
+  XSetForeground(wp->disp, wp->gc_frame, wp->pix_fg);
+  if (bw > 1U && bh > 1U)
+    XDrawRectangle(wp->disp, wp->win_pix, wp->gc_frame, bx, by, bw - 1, bh - 1);
+
+  /* draw battery capacity */
+  pct = (battery_level < 0) ? 0U :
+    (battery_level > 100 ? 100U : (unsigned int)battery_level);
+  col_in  = ac_line ? wp->onin  : wp->offin;
+  col_out = ac_line ? wp->onout : wp->offout;
+
+  if (bw > 2U && bh > 2U) {
+    XSetForeground(wp->disp, wp->gc_fill, col_out);
+    XFillRectangle(wp->disp, wp->win_pix, wp->gc_fill, bx + 1U, by + 1U, bw - 2U, bh - 2U);
+
+    fill_w = (bw - 2U) * pct / 100U;
+    XSetForeground(wp->disp, wp->gc_fill, col_in);
+    if (fill_w > 0U)
+      XFillRectangle(wp->disp, wp->win_pix, wp->gc_fill, bx + 1U, by + 1U, fill_w, bh - 2U);
+  }
+
+  /* capacity percentage */
+  draw_label(wp, wp->win_pix, pct);
+}
+
+/*
+ * render_history:
+ * the graph of the last samples; unless full, only scroll what is
+ * in win_pix by the samples added since and paint their columns
+ */
+static void render_history(struct widget *wp, int full)
+{
+  static XRectangle rects[4][HISTORY_MAX];
+  int nrects[4] = { 0, 0, 0, 0 };
+  unsigned long cols[4];
+  unsigned int width, height, margin, bx, by, bw, bh, iw, ih, n, k;
+  int i;
+
+  width = wp->win_w;
+  height = wp->win_h;
+  margin = (width < 32 || height < 12) ? 1u : 2u;
+  bx = by = margin;
+  bw = (width > margin * 2U) ? (width - margin * 2U) : width;
+  bh = (height > margin * 2U) ? (height - margin * 2U) : height;
+  if (bw <= 2U || bh <= 2U)
+    return;
+  iw = bw - 2U;
+  ih = bh - 2U;
+
+  n = history_serial - wp->history_seen;
+  wp->history_seen = history_serial;
+  if (full || n >= iw) {
+    XSetForeground(wp->disp, wp->gc_fill, wp->pix_bg);
+    XFillRectangle(wp->disp, wp->win_pix, wp->gc_fill, 0, 0, width, height);
+    XSetForeground(wp->disp, wp->gc_frame, wp->pix_fg);
+    XDrawRectangle(wp->disp, wp->win_pix, wp->gc_frame, bx, by, bw - 1, bh - 1);
+    n = iw;
+  } else if (n == 0) {
+    return;
+  } else {
+    /* one CopyArea moves everything already drawn */
+    XCopyArea(wp->disp, wp->win_pix, wp->win_pix, wp->gc_fill,
+              bx + 1U + n, by + 1U, iw - n, ih, bx + 1U, by + 1U);
+  }
+  if (n > history_serial)
+    n = history_serial;		/* the rest stays background */
+  if (n > HISTORY_MAX)
+    n = HISTORY_MAX;
+
+  /* the new columns, batched by color */
+  for (k = 0; k < n; k++) {
+    unsigned int j = (history_serial - 1 - k) % HISTORY_MAX;
+    unsigned int fill = ih * history_level[j] / 100U;
+    int c = history_ac[j] ? 0 : 2;	/* in, then out */
+    short x = bx + 1U + iw - 1U - k;
+    XRectangle *rp;
+
+    if (fill < ih) {
+      rp = &rects[c + 1][nrects[c + 1]++];
+      rp->x = x;
+      rp->y = by + 1U;
+      rp->width = 1;
+      rp->height = ih - fill;
+    }
+    if (fill > 0) {
+      rp = &rects[c][nrects[c]++];
+      rp->x = x;
+      rp->y = by + 1U + ih - fill;
+      rp->width = 1;
+      rp->height = fill;
+    }
+  }
+  cols[0] = wp->onin;
+  cols[1] = wp->onout;
+  cols[2] = wp->offin;
+  cols[3] = wp->offout;
+  for (i = 0; i < 4; i++) {
+    if (nrects[i] == 0)
+      continue;
+    XSetForeground(wp->disp, wp->gc_fill, cols[i]);
+    XFillRectangles(wp->disp, wp->win_pix, wp->gc_fill, rects[i], nrects[i]);
+  }
+}
+
+/*
+ * history_add:
+ * a sample for the graph, every one of them and not only changes
+ */
+static void history_add(const struct battery_sample *bs)
+{
+  unsigned int j = history_serial % HISTORY_MAX;
+
+  history_level[j] = bs->level < 0 ? 0 : (bs->level > 100 ? 100 : bs->level);
+  history_ac[j] = bs->ac_line > 0;
+  history_serial++;
+  damage_all(DAMAGE_HIST);
+}
+
+/*
+ * draw_widget:
+ * bring the pixmap up to date and show it with a single CopyArea
+ */
+static void draw_widget(struct widget *wp)
+{
+  int full = 0;
+
+  if (wp->win_pix == None || wp->pix_w != wp->win_w || wp->pix_h != wp->win_h) {
+    if (wp->win_pix != None)
+      XFreePixmap(wp->disp, wp->win_pix);
+    wp->win_pix = XCreatePixmap(wp->disp, wp->win, wp->win_w, wp->win_h, DefaultDepth(wp->disp, wp->scr));
+    wp->pix_w = wp->win_w;
+    wp->pix_h = wp->win_h;
+    wp->damage |= DAMAGE_STATE;
+    full = 1;
+  }
+  if (history_mode) {
+    unsigned int pct = (battery_level < 0) ? 0U :
+      (battery_level > 100 ? 100U : (unsigned int)battery_level);
+
+    /* the label is not scrolled along, it goes on top in the window */
+    if (wp->damage & (DAMAGE_STATE | DAMAGE_HIST))
+      render_history(wp, full);
+    XCopyArea(wp->disp, wp->win_pix, wp->win, wp->gc_fill, 0, 0, wp->pix_w, wp->pix_h, 0, 0);
+    draw_label(wp, wp->win, pct);
+    return;
+  }
+  if (wp->damage & DAMAGE_STATE)
+    render_widget(wp);
+  XCopyArea(wp->disp, wp->win_pix, wp->win, wp->gc_fill, 0, 0, wp->pix_w, wp->pix_h, 0, 0);
+}
+
+/*
+ * damage_all:
+ * mark every open widget, for changes not tied to one window
+ */
+static void damage_all(unsigned int what)
+{
+  int i;
+
+  for (i = 0; i < nwidgets; i++)
+    if (!widgets[i].closed)
+      widgets[i].damage |= what;
+}
+
+/*
+ * widgets_visible:
+ * true if any widget can be seen at all
+ */
+static int widgets_visible(void)
+{
+  int i;
+
+  for (i = 0; i < nwidgets; i++)
+    if (!widgets[i].closed && widgets[i].mapped && !widgets[i].obscured)
+      return 1;
+  return 0;
+}
+
+/*
+ * damage_expose:
+ * collect exposed areas into one bounding rectangle
+ */
+static void damage_expose(struct widget *wp, XExposeEvent *ev)
+{
+  int x1, y1, x2, y2;
+
+  if (!(wp->damage & DAMAGE_EXPOSE)) {
+    wp->damage_rect.x = ev->x;
+    wp->damage_rect.y = ev->y;
+    wp->damage_rect.width = ev->width;
+    wp->damage_rect.height = ev->height;
+    wp->damage |= DAMAGE_EXPOSE;
+    return;
+  }
+  x1 = wp->damage_rect.x < ev->x ? wp->damage_rect.x : ev->x;
+  y1 = wp->damage_rect.y < ev->y ? wp->damage_rect.y : ev->y;
+  x2 = wp->damage_rect.x + wp->damage_rect.width;
+  if (ev->x + ev->width > x2)
+    x2 = ev->x + ev->width;
+  y2 = wp->damage_rect.y + wp->damage_rect.height;
+  if (ev->y + ev->height > y2)
+    y2 = ev->y + ev->height;
+  wp->damage_rect.x = x1;
+  wp->damage_rect.y = y1;
+  wp->damage_rect.width = x2 - x1;
+  wp->damage_rect.height = y2 - y1;
+}
+
+/*
+ * redraw:
+ * repaint whatever has been damaged since the last call;
+ * called once per main loop iteration, the caller flushes
+ */
+void redraw(struct widget *wp)
+{
+  static unsigned long last_roundtrips = 0;
+
+  stats.redraws++;
+  if ((wp->damage & (DAMAGE_STATE | DAMAGE_SIZE | DAMAGE_HIST)) ||
+      wp->win_pix == None || (history_mode && (wp->damage & DAMAGE_EXPOSE))) {
+    draw_widget(wp);
+  } else if (wp->damage & DAMAGE_EXPOSE) {
+    XCopyArea(wp->disp, wp->win_pix, wp->win, wp->gc_fill,
+              wp->damage_rect.x, wp->damage_rect.y,
+              wp->damage_rect.width, wp->damage_rect.height,
+              wp->damage_rect.x, wp->damage_rect.y);
+  }
+  /* new text may need another size, a move needs no repaint */
+  if (wp->tip_mapped && (wp->damage & (DAMAGE_STATE | DAMAGE_TEXT | DAMAGE_MOVE)))
+    tip_show(wp, wp->tip_xroot, wp->tip_yroot);
+  if (wp->tip_mapped && (wp->damage & DAMAGE_TIP))
+    tip_draw(wp);
+  wp->damage = 0;
+
+  if (debug) {
+    fprintf(stderr, "xbattbar: redraw: %lu X round trips since last one\n",
+            stats.roundtrips - last_roundtrips);
+  }
+  last_roundtrips = stats.roundtrips;
+}
+
+/*
+ * tooltip to display status
+ */
+
+/* tracked from crossing events, no need to ask the server */
+static int pointer_in_windows(struct widget *wp)
+{
+  if (wp->in_win) {
+    return 1;
+  }
+  if (wp->tip_mapped && wp->in_tip) {
+    return 1;
+  }
+  return 0;
+}
+
+/* tipmsg for the current state, formatted only when that changes */
+static void tip_format(void)
+{
+  static int last_ac = -2, last_level = -2, last_remain = -2;
+  int len, r = remain < 0 ? -1 : remain / 60;
+
+  if (ac_line == last_ac && battery_level == last_level && r == last_remain)
+    return;
+  last_ac = ac_line;
+  last_level = battery_level;
+  last_remain = r;
+  tipmsg_serial++;
+
+  len = snprintf(tipmsg, sizeof(tipmsg),
+                 "AC %s-line: battery level is %d%%",
+                 ac_line ? "on" : "off", battery_level);
+  if (remain >= 0 && len < (int)sizeof(tipmsg))
+    snprintf(tipmsg + len, sizeof(tipmsg) - len, ", %d:%02d %s",
+             remain / 3600, (remain % 3600) / 60,
+             ac_line ? "to full" : "left");
+}
+
+static void tip_ensure_created(struct widget *wp)
+{
+  if (wp->tip)
+    return;
+  wp->tip = XCreateSimpleWindow(
+          wp->disp, RootWindow(wp->disp, wp->scr),
+          0, 0, 1, 1,               /* pos and size will be updated later */
+          TIP_FRAME_WIDTH,          /* width of frame */
+          wp->pix_fg, wp->pix_bg);
+  XSetWindowAttributes swa;
+  swa.override_redirect = True;     /* exclude from WM */
+  XChangeWindowAttributes(wp->disp, wp->tip, CWOverrideRedirect, &swa);
+  XSelectInput(wp->disp, wp->tip, ExposureMask |
+    EnterWindowMask | LeaveWindowMask | PointerMotionMask);
+}
+
+static void tip_draw(struct widget *wp)
+{
+  if (!wp->tip_mapped)
+    return;
+
+  unsigned int width = wp->tip_w, height = wp->tip_h;
+
+  /* background and frame */
+  XSetForeground(wp->disp, wp->gc_fill, wp->pix_bg);
+  XFillRectangle(wp->disp, wp->tip, wp->gc_fill, 0, 0, width, height);
+  XSetForeground(wp->disp, wp->gc_frame, wp->pix_fg);
+  XDrawRectangle(wp->disp, wp->tip, wp->gc_frame, 0, 0, width - 1, height - 1);
+
+  /* status strings */
+  if (wp->fontp != NULL && wp->gc_text != 0) {
+    int ty = (int)tip_pad_y + wp->fontp->ascent;
+    int tx = (int)tip_pad_x;
+
+    XSetForeground(wp->disp, wp->gc_text, wp->pix_fg);
+    XDrawString(wp->disp, wp->tip, wp->gc_text, tx, ty, tipmsg, strlen(tipmsg));
+  }
+}
+
+static void tip_show(struct widget *wp, int root_x, int root_y)
+{
+  int tw, th, x, y, sw, sh;
+  unsigned int width = wp->tip_w, height = wp->tip_h;
+  int len;
+
+  tip_ensure_created(wp);
+  tip_format();
+
+  /* Calculate window size, only for new text */
+  if (wp->tip_serial != tipmsg_serial) {
+    len = strlen(tipmsg);
+    if (widget_font(wp) != NULL) {
+      tw = XTextWidth(wp->fontp, tipmsg, len);
+      th = wp->fontp->ascent + wp->fontp->descent;
+    } else {
+      tw = DefaultFontW * len;
+      th = DefaultFontH;
+    }
+    width = (unsigned int)(tw + tip_pad_x * 2);
+    height = (unsigned int)(th + tip_pad_y * 2);
+    wp->tip_serial = tipmsg_serial;
+    wp->damage |= DAMAGE_TIP;
+  }
+
+  /* Adjust window location */
+  x = root_x + 8;
+  y = root_y - height - (TIP_FRAME_WIDTH * 2 + 2);
+  sw = DisplayWidth(wp->disp, wp->scr);
+  sh = DisplayHeight(wp->disp, wp->scr);
+  if (x + (int)width > sw)
+    x = sw - (int)width;
+  if (y + (int)height > sh)
+    y = sh - (int)height;
+  if (x < 0)
+    x = 0;
+  if (y < 0)
+    y = 0;
+
+  if (!wp->tip_mapped) {
+    XMoveResizeWindow(wp->disp, wp->tip, x, y, width, height);
+    XMapRaised(wp->disp, wp->tip);
+    wp->tip_mapped = 1;
+    wp->damage |= DAMAGE_TIP;
+    stats.tip_shows++;
+  } else if (width != wp->tip_w || height != wp->tip_h) {
+    XMoveResizeWindow(wp->disp, wp->tip, x, y, width, height);
+    stats.tip_moves++;
+  } else if (x != wp->tip_x || y != wp->tip_y) {
+    /* the contents stay as they are */
+    XMoveWindow(wp->disp, wp->tip, x, y);
+    stats.tip_moves++;
+  }
+  wp->tip_x = x;
+  wp->tip_y = y;
+  wp->tip_w = width;
+  wp->tip_h = height;
+}
+
+static void tip_hide(struct widget *wp)
+{
+  if (!wp->tip)
+    return;
+  XUnmapWindow(wp->disp, wp->tip);
+  wp->tip_mapped = 0;
+  wp->in_tip = 0;
+}
+
+/*
+ * estimating time for battery remaining / charging
+ *
+ * The latest samples are kept in a ring with their timestamps and the
+ * rate is the least squares slope of level over time.  The sums of the
+ * fit are updated as samples enter and leave the ring, so a sample
+ * costs O(1) however long the window is.
+ * The ring starts over when the AC line changes, and samples taken
+ * within AcSettle seconds after that are left out: the level reported
+ * right after plugging or unplugging jumps about.  So does a jump of
+ * more than LevelJump between two samples, after a recalibration.
+ *
+ * Where the backend reports the power draw and the energy left, that
+ * gives an estimate from a single sample and is used instead.
+ */
+
+#define CriticalLevel  5
+#define HIST_MAX	64	/* samples in the ring */
+#define HistWindow	1800	/* oldest sample used, in sec */
+#define HistRebase	86400	/* rebase timestamps after, in sec */
+#define AcSettle	30	/* sec */
+#define LevelJump	5	/* percent */
+#define HistMinSlope	(1.0 / HistWindow) /* percent/sec, below is no trend */
+#define RemainMax	(7 * 86400)	/* longest estimate, in sec */
+
+struct hist_sample {
+  double t;			/* sec since hist_base */
+  int level;
+};
+
+static struct hist_sample hist[HIST_MAX];
+static int hist_head = 0, hist_len = 0;	/* oldest sample, number of */
+static struct timespec hist_base;
+static double hist_st, hist_sl, hist_stt, hist_stl;	/* sums of the fit */
+static int hist_ac = -1;		/* AC line of the samples in the ring */
+static struct timespec hist_settle;	/* samples before are left out */
+
+#define RateSmooth	60	/* sec */
+
+static double rate_avg = -1;		/* mW, -1 if unknown */
+static struct timespec rate_ts;
+
+static void hist_sum(const struct hist_sample *hp, int sign)
+{
+  hist_st += sign * hp->t;
+  hist_sl += sign * hp->level;
+  hist_stt += sign * hp->t * hp->t;
+  hist_stl += sign * hp->t * hp->level;
+}
+
+static void hist_reset(const struct timespec *now)
+{
+  hist_head = hist_len = 0;
+  hist_st = hist_sl = hist_stt = hist_stl = 0;
+  hist_base = *now;
+}
+
+static void hist_rebase(const struct timespec *now)
+{
+  struct timespec d;
+  double shift;
+  int i;
+
+  /* keep t small, or the sums lose the precision the fit needs */
+  timespec_sub((struct timespec *)now, &hist_base, &d);
+  shift = d.tv_sec + d.tv_nsec / 1e9;
+  hist_base = *now;
+  hist_st = hist_sl = hist_stt = hist_stl = 0;
+  for (i = 0; i < hist_len; i++) {
+    struct hist_sample *hp = &hist[(hist_head + i) % HIST_MAX];
+
+    hp->t -= shift;
+    hist_sum(hp, 1);
+  }
+}
+
+static void hist_add(const struct timespec *ts, int level)
+{
+  struct timespec d;
+  struct hist_sample *hp;
+  double t;
+
+  timespec_sub((struct timespec *)ts, &hist_base, &d);
+  t = d.tv_sec + d.tv_nsec / 1e9;
+  if (t > HistRebase) {
+    hist_rebase(ts);
+    t = 0;
+  }
+
+  while (hist_len > 0 &&
+         (hist_len == HIST_MAX || hist[hist_head].t < t - HistWindow)) {
+    hist_sum(&hist[hist_head], -1);
+    hist_head = (hist_head + 1) % HIST_MAX;
+    hist_len--;
+  }
+  hp = &hist[(hist_head + hist_len) % HIST_MAX];
+  hp->t = t;
+  hp->level = level;
+  hist_sum(hp, 1);
+  hist_len++;
+}
+
+/*
+ * rate_update:
+ * average the power draw over about RateSmooth seconds
+ */
+static void rate_update(const struct battery_sample *bs)
+{
+  struct timespec d;
+  double dt;
+
+  if (bs->rate < 0) {
+    rate_avg = -1;
+    return;
+  }
+  if (rate_avg < 0) {
+    rate_avg = bs->rate;
+  } else {
+    timespec_sub((struct timespec *)&bs->ts, &rate_ts, &d);
+    dt = d.tv_sec + d.tv_nsec / 1e9;
+    rate_avg += (bs->rate - rate_avg) * dt / (RateSmooth + dt);
+  }
+  rate_ts = bs->ts;
+}
+
+/*
+ * rate_remain:
+ * time to go at the present power draw, -1 if unknown
+ */
+static int rate_remain(const struct battery_sample *bs)
+{
+  double left;
+
+  if (rate_avg < 1 || bs->energy < 0)
+    return -1;
+  if (!bs->ac_line) {
+    left = bs->energy;
+    if (bs->energy_full > 0)
+      left -= bs->energy_full * CriticalLevel / 100.0;
+  } else {
+    if (bs->energy_full <= 0)
+      return -1;
+    left = bs->energy_full - bs->energy;
+  }
+  return left > 0 ? (int)(left * 3600 / rate_avg) : 0;
+}
+
+/*
+ * hist_remain:
+ * time to go at the rate the level has been moving, -1 if unknown
+ */
+static int hist_remain(int ac)
+{
+  double n, denom, slope, level, r;
+
+  n = hist_len;
+  denom = n * hist_stt - hist_st * hist_st;
+  if (hist_len < 2 || denom <= 0)
+    return -1;
+  slope = (n * hist_stl - hist_st * hist_sl) / denom;	/* percent/sec */
+
+  /* the fitted level now, smoother than the integer percentage */
+  level = (hist_sl + slope * (n * hist[(hist_head + hist_len - 1) %
+                                       HIST_MAX].t - hist_st)) / n;
+  /* a flat level leaves only rounding error in the sums */
+  if (slope > -HistMinSlope && slope < HistMinSlope)
+    return -1;
+
+  if (!ac && slope < 0)
+    r = level > CriticalLevel ? (level - CriticalLevel) / -slope : 0;
+  else if (ac && slope > 0)
+    r = level < 100 ? (100 - level) / slope : 0;
+  else
+    return -1;
+  return r < RemainMax ? (int)r : RemainMax;
+}
+
+/*
+ * estimate_update:
+ * called with every new sample; the power draw gives an estimate
+ * right away where the backend knows it, the level history otherwise
+ */
+void estimate_update(const struct battery_sample *bs)
+{
+  int last, r;
+
+  if (bs->ac_line != hist_ac) {
+    hist_ac = bs->ac_line;
+    hist_reset(&bs->ts);
+    hist_settle = bs->ts;
+    timespec_add_msec(&hist_settle, (time_t)AcSettle * 1000);
+    rate_avg = -1;
+  }
+  rate_update(bs);
+
+  if (timespec_cmp((struct timespec *)&bs->ts, &hist_settle) >= 0) {
+    if (hist_len > 0) {
+      last = hist[(hist_head + hist_len - 1) % HIST_MAX].level;
+      if (bs->level - last > LevelJump || last - bs->level > LevelJump)
+        hist_reset(&bs->ts);
+    }
+    hist_add(&bs->ts, bs->level);
+  }
+
+  if ((r = rate_remain(bs)) < 0)
+    r = hist_remain(bs->ac_line);
+  remain = r;
+}
+
+/*
+ * estimate_remain:
+ * report the estimate when the level has changed
+ */
+void estimate_remain(void)
+{
+  if (remain < 0)
+    return;
+  event_push("{\"event\":\"estimate\",\"time\":%ld,\"ac\":%d,"
+             "\"remain\":%d}", (long)time(NULL), ac_line, remain);
+  if (debug) {
+    fprintf(stderr, "xbattbar: %s remain: %2d hr. %2d min. %2d sec.\n",
+            ac_line ? "charging" : "battery",
+            remain / 3600, (remain % 3600) / 60, remain % 60);
+  }
+}
+
+/*
+ * adaptive polling:
+ * with -P, the polling interval moves between bi_interval and
+ * bi_interval_max.  Full on AC it stays at the maximum, near
+ * CriticalLevel on battery at the minimum.  Otherwise it backs off
+ * while nothing changes and is kept short enough to catch every
+ * percent step at the rate the level has been changing.
+ * poll_update() takes one step per polled sample, once it is in;
+ * everybody else only asks poll_interval() for the current value.
+ */
+
+static int poll_cur = 0;		/* current interval in sec */
+static int poll_changed = 0;		/* last sample changed the state */
+static double level_period = 0;		/* sec per 1% change, 0 if unknown */
+
+int poll_interval(void)
+{
+  /* nobody is looking: the estimate and any stream can wait */
+  if (bi_interval_hidden > bi_interval && nwidgets > 0 && !widgets_visible())
+    return bi_interval_hidden;
+
+  if (bi_interval_max <= bi_interval || poll_cur < bi_interval)
+    return bi_interval;
+  return poll_cur;
+}
+
+void poll_update(void)
+{
+  if (bi_interval_max <= bi_interval)
+    return;
+
+  if (poll_cur < bi_interval)
+    poll_cur = bi_interval;
+
+  if (ac_line && battery_level >= 100) {
+    poll_cur = bi_interval_max;
+  } else if (!ac_line && battery_level <= CriticalLevel * 2) {
+    poll_cur = bi_interval;
+  } else if (poll_changed) {
+    poll_cur = bi_interval;
+  } else {
+    poll_cur *= 2;
+  }
+
+  /* don't miss percent steps while the level is moving */
+  if (level_period > 0 && poll_cur > level_period / 2)
+    poll_cur = (int)(level_period / 2);
+
+  if (poll_cur < bi_interval)
+    poll_cur = bi_interval;
+  if (poll_cur > bi_interval_max)
+    poll_cur = bi_interval_max;
+}
+
+/*
+ * recording and replaying sample traces
+ *
+ * A trace is a trace_header followed by fixed size trace_records
+ * in host byte order.  The recorder appends one record per sample;
+ * the replay backend maps the whole trace and feeds it back either
+ * at its original pace or as fast as the main loop can take it.
+ */
+
+#define TRACE_MAGIC	0x58425452	/* "XBTR" */
+#define TRACE_VERSION	2	/* 1 had no energy */
+
+struct trace_header {
+  uint32_t magic;
+  uint32_t version;
+};
+
+struct trace_record {
+  int64_t ts;			/* CLOCK_MONOTONIC in nsec */
+  int32_t rate;			/* mW, -1 if unknown */
+  int16_t level;
+  int8_t ac_line;
+  int8_t pad;
+  int32_t energy;		/* mWh, -1 if unknown */
+  int32_t energy_full;
+};
+
+#define TRACE_RECSIZE_V1	16
+
+static int record_fd = -1;
+
+static int64_t timespec_to_nsec(const struct timespec *tsp)
+{
+  return (int64_t)tsp->tv_sec * 1000000000 + tsp->tv_nsec;
+}
+
+static void nsec_to_timespec(int64_t ns, struct timespec *tsp)
+{
+  tsp->tv_sec = ns / 1000000000;
+  tsp->tv_nsec = ns % 1000000000;
+}
+
+/*
+ * trace_pack, trace_unpack:
+ * the one place a sample turns into a record and back, for both
+ * the trace file and the persistent history
+ */
+static void trace_pack(struct trace_record *tr,
+                       const struct battery_sample *bs)
+{
+  memset(tr, 0, sizeof(*tr));
+  tr->ts = timespec_to_nsec(&bs->ts);
+  tr->rate = bs->rate;
+  tr->level = (int16_t)bs->level;
+  tr->ac_line = (int8_t)bs->ac_line;
+  tr->energy = bs->energy;
+  tr->energy_full = bs->energy_full;
+}
+
+static void trace_unpack(struct battery_sample *bs,
+                         const struct trace_record *tr)
+{
+  nsec_to_timespec(tr->ts, &bs->ts);
+  bs->ac_line = tr->ac_line;
+  bs->level = tr->level;
+  bs->rate = tr->rate;
+  bs->energy = tr->energy;
+  bs->energy_full = tr->energy_full;
+}
+
+/*
+ * record_open:
+ * open (or append to) a trace file; only a trace of this very
+ * version is appended to, anything else is left alone
+ */
+void record_open(const char *path)
+{
+  struct stat st;
+  struct trace_header th;
+
+  if ((record_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0 ||
+      fstat(record_fd, &st) < 0) {
+    fprintf(stderr, "xbattbar: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  if (st.st_size > 0) {
+    if (pread(record_fd, &th, sizeof(th), 0) != sizeof(th) ||
+        th.magic != TRACE_MAGIC) {
+      fprintf(stderr, "xbattbar: %s: not a trace file\n", path);
+      exit(1);
+    }
+    if (th.version != TRACE_VERSION) {
+      fprintf(stderr, "xbattbar: %s: trace version %u, "
+              "can only append to version %u\n", path,
+              (unsigned int)th.version, TRACE_VERSION);
+      exit(1);
+    }
+    if ((st.st_size - sizeof(th)) % sizeof(struct trace_record) != 0) {
+      /* new records would be out of step with the old ones */
+      fprintf(stderr, "xbattbar: %s: trace ends in a partial record\n",
+              path);
+      exit(1);
+    }
+    return;
+  }
+  th.magic = TRACE_MAGIC;
+  th.version = TRACE_VERSION;
+  if (write(record_fd, &th, sizeof(th)) != sizeof(th)) {
+    fprintf(stderr, "xbattbar: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+}
+
+static void record_sample(const struct battery_sample *bs)
+{
+  struct trace_record tr;
+
+  if (record_fd < 0)
+    return;
+  trace_pack(&tr, bs);
+  if (write(record_fd, &tr, sizeof(tr)) != sizeof(tr)) {
+    perror("xbattbar: trace");
+    close(record_fd);
+    record_fd = -1;
+  }
+}
+
+/*
+ * persistent history:
+ * the latest samples are also kept in a small ring mapped from a
+ * file, normally in $XDG_RUNTIME_DIR, so that a restarted xbattbar
+ * has an estimate (and a graph with -H) from its first frame on.
+ * A sample is one record stored in place, without fsync; losing the
+ * last few to a crash costs nothing but a slightly colder start.
+ * Timestamps are CLOCK_MONOTONIC, which restarts with the system:
+ * the header keeps the offset to CLOCK_REALTIME to tell the boots
+ * apart.
+ */
+#define PERSIST_MAGIC	0x58424850	/* "XBHP" */
+#define PERSIST_VERSION	1
+#define PERSIST_MAX	HISTORY_MAX
+#define PERSIST_SKEW	2		/* sec the clocks may drift apart */
+
+struct persist_file {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nrec;		/* records in the ring */
+  uint32_t pad;
+  uint64_t serial;		/* records ever written */
+  int64_t boot;			/* CLOCK_REALTIME - CLOCK_MONOTONIC, nsec */
+  struct trace_record rec[PERSIST_MAX];
+};
+
+static struct persist_file *persist_map = NULL;
+
+static int64_t persist_boot(void)
+{
+  struct timespec rt, mt;
+
+  clock_gettime(CLOCK_REALTIME, &rt);
+  clock_gettime(CLOCK_MONOTONIC, &mt);
+  return timespec_to_nsec(&rt) - timespec_to_nsec(&mt);
+}
+
+static const char *persist_default(void)
+{
+  static char path[1024];
+  const char *dir;
+
+  if ((dir = getenv("XDG_RUNTIME_DIR")) != NULL && *dir != '\0')
+    snprintf(path, sizeof(path), "%s/xbattbar.history", dir);
+  else if ((dir = getenv("XDG_STATE_HOME")) != NULL && *dir != '\0')
+    snprintf(path, sizeof(path), "%s/xbattbar.history", dir);
+  else if ((dir = getenv("HOME")) != NULL && *dir != '\0')
+    snprintf(path, sizeof(path), "%s/.local/state/xbattbar.history", dir);
+  else
+    return NULL;
+  return path;
+}
+
+/*
+ * persist_open:
+ * map the history file, unless another instance has it already;
+ * NULL for the default place
+ */
+void persist_open(const char *path)
+{
+  struct stat st;
+  struct persist_file *pf;
+  int fd;
+
+  if (path == NULL && (path = persist_default()) == NULL)
+    return;
+  if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0)
+    goto fail;
+  if (flock(fd, LOCK_EX | LOCK_NB) < 0 || fstat(fd, &st) < 0)
+    goto fail;
+  if (st.st_size != sizeof(*pf) &&
+      (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(*pf)) < 0))
+    goto fail;
+  pf = mmap(NULL, sizeof(*pf), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (pf == MAP_FAILED)
+    goto fail;
+  /* the lock goes with the fd, which stays open for good */
+
+  if (pf->magic != PERSIST_MAGIC || pf->version != PERSIST_VERSION ||
+      pf->nrec != PERSIST_MAX) {
+    memset(pf, 0, sizeof(*pf));
+    pf->magic = PERSIST_MAGIC;
+    pf->version = PERSIST_VERSION;
+    pf->nrec = PERSIST_MAX;
+  }
+  persist_map = pf;
+  return;
+
+ fail:
+  if (debug)
+    fprintf(stderr, "xbattbar: %s: %s, history not kept\n", path,
+            errno != 0 ? strerror(errno) : "unusable");
+  if (fd >= 0)
+    close(fd);
+}
+
+/*
+ * persist_load:
+ * warm the estimator (and the graph) up with what has been kept
+ * from this boot, within the window the estimator looks at
+ */
+void persist_load(void)
+{
+  struct persist_file *pf = persist_map;
+  struct timespec now;
+  struct battery_sample bs;
+  int64_t t, last = -1, oldest;
+  uint64_t i, n;
+  int64_t skew;
+
+  if (pf == NULL || pf->serial == 0)
+    return;
+  skew = persist_boot() - pf->boot;
+  if (skew < 0)
+    skew = -skew;
+  if (skew > (int64_t)PERSIST_SKEW * 1000000000)
+    return;			/* another boot, or suspended since */
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  t = timespec_to_nsec(&now);
+  oldest = t - (int64_t)HistWindow * 1000000000;
+  n = pf->serial < PERSIST_MAX ? pf->serial : PERSIST_MAX;
+  for (i = pf->serial - n; i < pf->serial; i++) {
+    const struct trace_record *tr = &pf->rec[i % PERSIST_MAX];
+
+    /* a record torn by a crash would be out of order or range */
+    if (tr->ts <= last || tr->ts > t || tr->level < 0 || tr->level > 100)
+      continue;
+    last = tr->ts;
+    trace_unpack(&bs, tr);
+    if (history_mode)
+      history_add(&bs);
+    if (tr->ts >= oldest)
+      estimate_update(&bs);
+  }
+}
+
+static void persist_sample(const struct battery_sample *bs)
+{
+  struct persist_file *pf = persist_map;
+
+  if (pf == NULL)
+    return;
+  trace_pack(&pf->rec[pf->serial % PERSIST_MAX], bs);
+  pf->serial++;
+  pf->boot = persist_boot();
+}
+
+static const char *replay_rec = NULL;
+static size_t replay_recsize, replay_nrec = 0, replay_pos = 0;
+static uint32_t replay_version;
+static void *replay_map = MAP_FAILED;
+static size_t replay_len = 0;
+static int64_t replay_base;	/* start of replay on our clock */
+static int replay_pipe[2] = { -1, -1 };
+#ifdef USE_TIMERFD
+static int replay_timer = -1;
+#endif
+
+static const struct trace_record *replay_record(size_t i)
+{
+  return (const struct trace_record *)(replay_rec + i * replay_recsize);
+}
+
+static int replay_probe(void)
+{
+  return replay_file != NULL;
+}
+
+/* when the next record is due on our clock */
+static int64_t replay_due(void)
+{
+  if (replay_pos >= replay_nrec) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_to_nsec(&now);
+  }
+  return replay_base + (replay_record(replay_pos)->ts - replay_record(0)->ts);
+}
+
+#ifndef USE_TIMERFD
+static void replay_alarm(int sig)
+{
+  int saved = errno;
+
+  (void)sig;
+  if (write(replay_pipe[1], "", 1) < 0) {
+    /* pipe full: already readable */
+  }
+  errno = saved;
+}
+#endif
+
+/*
+ * make the replay fd readable when the next record is due:
+ * a timerfd on Linux, SIGALRM writing into a pipe elsewhere.
+ */
+static void replay_arm(void)
+{
+  int64_t due = replay_due();
+#ifdef USE_TIMERFD
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  nsec_to_timespec(due, &its.it_value);
+  timerfd_settime(replay_timer, TFD_TIMER_ABSTIME, &its, NULL);
+#else
+  struct itimerval itv;
+  struct timespec now;
+  int64_t d;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  d = due - timespec_to_nsec(&now);
+  if (d < 1000)
+    d = 1000;	/* zero would disarm it */
+  memset(&itv, 0, sizeof(itv));
+  itv.it_value.tv_sec = (time_t)(d / 1000000000);
+  itv.it_value.tv_usec = (suseconds_t)(d % 1000000000 / 1000);
+  setitimer(ITIMER_REAL, &itv, NULL);
+#endif
+}
+
+static int replay_open(void)
+{
+  int fd;
+  struct stat st;
+  const struct trace_header *th;
+  struct timespec now;
+
+  if (replay_file == NULL) {
+    fprintf(stderr, "xbattbar: no trace file to replay\n");
+    return -1;
+  }
+  if ((fd = open(replay_file, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "xbattbar: %s: %s\n", replay_file, strerror(errno));
+    return -1;
+  }
+  replay_len = (size_t)st.st_size;
+  if (replay_len < sizeof(*th) + TRACE_RECSIZE_V1 ||
+      (replay_map = mmap(NULL, replay_len, PROT_READ, MAP_PRIVATE,
+                         fd, 0)) == MAP_FAILED) {
+    fprintf(stderr, "xbattbar: %s: empty trace\n", replay_file);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  th = replay_map;
+  if (th->magic != TRACE_MAGIC ||
+      th->version < 1 || th->version > TRACE_VERSION) {
+    fprintf(stderr, "xbattbar: %s: not a trace file\n", replay_file);
+    return -1;
+  }
+  replay_version = th->version;
+  replay_recsize = replay_version == 1 ?
+    TRACE_RECSIZE_V1 : sizeof(struct trace_record);
+  replay_rec = (const char *)(th + 1);
+  replay_nrec = (replay_len - sizeof(*th)) / replay_recsize;
+  replay_pos = 0;
+  if (replay_nrec == 0) {
+    fprintf(stderr, "xbattbar: %s: empty trace\n", replay_file);
+    return -1;
+  }
+  madvise(replay_map, replay_len, MADV_SEQUENTIAL);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  replay_base = timespec_to_nsec(&now);
+
+  /* keep a readable fd around so that the main loop never sleeps */
+  if (replay_fast) {
+    if (pipe(replay_pipe) < 0 || write(replay_pipe[1], "", 1) != 1) {
+      perror("xbattbar: pipe");
+      return -1;
+    }
+    return 0;
+  }
+
+  /* otherwise wake up exactly when each record is due */
+#ifdef USE_TIMERFD
+  replay_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (replay_timer < 0) {
+    perror("xbattbar: timerfd_create");
+    return -1;
+  }
+#else
+  {
+    struct sigaction sa;
+
+    if (pipe(replay_pipe) < 0) {
+      perror("xbattbar: pipe");
+      return -1;
+    }
+    fcntl(replay_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(replay_pipe[1], F_SETFL, O_NONBLOCK);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = replay_alarm;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, NULL);
+  }
+#endif
+  replay_arm();
+  return 0;
+}
+
+static int replay_sample(struct battery_sample *bs)
+{
+  const struct trace_record *tr;
+  int64_t t0 = replay_record(0)->ts;
+
+  if (replay_pos >= replay_nrec) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(stderr, "xbattbar: replayed %lu samples in %.3f sec.\n",
+            (unsigned long)replay_nrec,
+            (timespec_to_nsec(&now) - replay_base) / 1e9);
+    exit(0);
+  }
+
+  if (!replay_fast && replay_pos > 0 &&
+      timespec_to_nsec(&bs->ts) < replay_due()) {
+    /*
+     * polled before the next record is due: the battery still
+     * reads what the last record said, as real hardware would.
+     */
+    tr = replay_record(replay_pos - 1);
+  } else {
+    /* one record per sample, none skipped even if we fall behind */
+    tr = replay_record(replay_pos++);
+    /* rebase the trace onto our clock */
+    nsec_to_timespec(replay_base + (tr->ts - t0), &bs->ts);
+    if (!replay_fast)
+      replay_arm();
+  }
+
+  bs->ac_line = tr->ac_line;
+  bs->level = tr->level;
+  bs->rate = tr->rate;
+  if (replay_version >= 2) {
+    bs->energy = tr->energy;
+    bs->energy_full = tr->energy_full;
+  }
+  return 0;
+}
+
+static void replay_close(void)
+{
+  if (replay_map != MAP_FAILED)
+    munmap(replay_map, replay_len);
+  replay_map = MAP_FAILED;
+  if (replay_pipe[0] >= 0) {
+#ifndef USE_TIMERFD
+    if (!replay_fast) {
+      struct itimerval itv;
+
+      memset(&itv, 0, sizeof(itv));
+      setitimer(ITIMER_REAL, &itv, NULL);
+      signal(SIGALRM, SIG_DFL);
+    }
+#endif
+    close(replay_pipe[0]);
+    close(replay_pipe[1]);
+    replay_pipe[0] = replay_pipe[1] = -1;
+  }
+#ifdef USE_TIMERFD
+  if (replay_timer >= 0)
+    close(replay_timer);
+  replay_timer = -1;
+#endif
+}
+
+static int replay_fd(void)
+{
+#ifdef USE_TIMERFD
+  if (!replay_fast)
+    return replay_timer;
+#endif
+  return replay_pipe[0];
+}
+
+/* the timer fired: the next record is due (or the trace is over) */
+static int replay_pending(void)
+{
+  struct timespec now;
+
+  if (replay_fast)
+    return 1;
+#ifdef USE_TIMERFD
+  {
+    uint64_t n;
+
+    while (read(replay_timer, &n, sizeof(n)) > 0)
+      ;
+  }
+#else
+  {
+    char buf[64];
+
+    while (read(replay_pipe[0], buf, sizeof(buf)) > 0)
+      ;
+  }
+#endif
+  if (replay_pos >= replay_nrec)
+    return 1;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return timespec_to_nsec(&now) >= replay_due();
+}
+
+static const struct battery_backend replay_backend = {
+  "replay", replay_probe, replay_open, replay_sample, replay_close,
+  replay_fd, replay_pending
+};
+
+/*
+ * sharing samples between instances
+ *
+ * With -S, every sample is also published in a small file which
+ * other instances map with -m instead of reading the hardware, so
+ * a dozen sessions on one host cost one set of ACPI reads.
+ * The file is updated in place under a sequence lock: the count is
+ * odd while the writer is in the middle of an update, and a reader
+ * retries if it has changed under it.  After an update the writer
+ * touches the file, which wakes readers through inotify on Linux;
+ * elsewhere they just check the count when they poll.
+ */
+
+#define SHM_MAGIC	0x58425348	/* "XBSH" */
+#define SHM_VERSION	1
+#define SHM_RETRY	1000		/* give up on a writer died halfway */
+#define SHM_STALE	3		/* publisher intervals without a sample */
+
+struct shm_state {
+  uint32_t magic;
+  uint32_t version;
+  volatile uint32_t seq;	/* odd while being written */
+  int32_t interval;		/* of the publisher, in sec */
+  int64_t ts;			/* CLOCK_MONOTONIC in nsec */
+  int32_t ac_line;
+  int32_t level;
+  int32_t rate;
+  int32_t energy;
+  int32_t energy_full;
+  int32_t pad;
+};
+
+static struct shm_state *shm_pub = NULL;	/* state we publish, -S */
+static int shm_pub_fd = -1;
+
+/*
+ * shm_publish_open:
+ * map the file to publish samples in; an existing file is updated
+ * in place, so that readers mapping it keep seeing our samples
+ */
+void shm_publish_open(const char *path)
+{
+  char tmp[1024];
+  int fd;
+  struct shm_state *sp;
+
+  if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+    /* a new file only appears once it is valid */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ||
+        ftruncate(fd, sizeof(*sp)) < 0) {
+      fprintf(stderr, "xbattbar: %s: %s\n", tmp, strerror(errno));
+      exit(1);
+    }
+  } else {
+    tmp[0] = '\0';
+    if (ftruncate(fd, sizeof(*sp)) < 0) {
+      fprintf(stderr, "xbattbar: %s: %s\n", path, strerror(errno));
+      exit(1);
+    }
+  }
+  sp = mmap(NULL, sizeof(*sp), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (sp == MAP_FAILED) {
+    fprintf(stderr, "xbattbar: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+
+  sp->seq |= 1;
+  __sync_synchronize();
+  sp->magic = SHM_MAGIC;
+  sp->version = SHM_VERSION;
+  sp->interval = poll_interval();
+  sp->ts = 0;
+  sp->level = -1;
+  __sync_synchronize();
+  sp->seq++;
+
+  if (tmp[0] != '\0' && rename(tmp, path) < 0) {
+    fprintf(stderr, "xbattbar: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  shm_pub = sp;
+  shm_pub_fd = fd;
+}
+
+static void shm_publish(const struct battery_sample *bs)
+{
+  struct shm_state *sp = shm_pub;
+
+  if (sp == NULL)
+    return;
+  sp->seq++;
+  __sync_synchronize();
+  sp->interval = poll_interval();
+  sp->ts = timespec_to_nsec(&bs->ts);
+  sp->ac_line = bs->ac_line;
+  sp->level = bs->level;
+  sp->rate = bs->rate;
+  sp->energy = bs->energy;
+  sp->energy_full = bs->energy_full;
+  __sync_synchronize();
+  sp->seq++;
+
+  /* wake up readers waiting on inotify */
+  futimens(shm_pub_fd, NULL);
+}
+
+/*
+ * shm backend: samples published by another instance
+ */
+static const struct shm_state *shm_map = NULL;
+static int shm_stale = 0;		/* publisher has gone quiet */
+#ifdef linux
+static int shm_inotify = -1;
+#endif
+
+static int shm_probe(void)
+{
+  return shm_file != NULL;
+}
+
+static int shm_open_state(void)
+{
+  int fd;
+  void *p;
+
+  if (shm_file == NULL) {
+    fprintf(stderr, "xbattbar: no state file to read\n");
+    return -1;
+  }
+  if ((fd = open(shm_file, O_RDONLY | O_CLOEXEC)) < 0) {
+    fprintf(stderr, "xbattbar: %s: %s\n", shm_file, strerror(errno));
+    return -1;
+  }
+  p = mmap(NULL, sizeof(*shm_map), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "xbattbar: %s: %s\n", shm_file, strerror(errno));
+    return -1;
+  }
+  shm_map = p;
+  if (shm_map->magic != SHM_MAGIC || shm_map->version != SHM_VERSION) {
+    fprintf(stderr, "xbattbar: %s: not a state file\n", shm_file);
+    return -1;
+  }
+
+#ifdef linux
+  shm_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (shm_inotify >= 0 &&
+      inotify_add_watch(shm_inotify, shm_file, IN_ATTRIB | IN_MODIFY) < 0) {
+    close(shm_inotify);
+    shm_inotify = -1;
+  }
+#endif
+  return 0;
+}
+
+static int shm_sample(struct battery_sample *bs)
+{
+  struct shm_state st;
+  uint32_t seq;
+  int i;
+
+  for (i = 0; i < SHM_RETRY; i++) {
+    seq = shm_map->seq;
+    __sync_synchronize();
+    if (seq & 1)
+      continue;
+    memcpy(&st, (const void *)shm_map, sizeof(st));
+    __sync_synchronize();
+    if (shm_map->seq == seq)
+      break;
+  }
+  if (i == SHM_RETRY || st.level < 0) {
+    /* nothing published yet: keep the sample as it is */
+    bs->level = battery_level < 0 ? 0 : battery_level;
+    bs->ac_line = ac_line < 0 ? 0 : ac_line;
+    return 0;
+  }
+
+  /* the publisher should have sampled again by now; say so once */
+  if (st.interval > 0) {
+    int64_t age = timespec_to_nsec(&bs->ts) - st.ts;
+    int stale = age > (int64_t)st.interval * SHM_STALE * 1000000000;
+
+    if (stale && !shm_stale)
+      fprintf(stderr, "xbattbar: %s: no sample for %d sec.\n",
+              shm_file, (int)(age / 1000000000));
+    else if (!stale && shm_stale)
+      fprintf(stderr, "xbattbar: %s: samples again\n", shm_file);
+    shm_stale = stale;
+  }
+
+  nsec_to_timespec(st.ts, &bs->ts);
+  bs->ac_line = st.ac_line;
+  bs->level = st.level;
+  bs->rate = st.rate;
+  bs->energy = st.energy;
+  bs->energy_full = st.energy_full;
+  return 0;
+}
+
+static void shm_close(void)
+{
+  if (shm_map != NULL)
+    munmap((void *)shm_map, sizeof(*shm_map));
+  shm_map = NULL;
+#ifdef linux
+  if (shm_inotify >= 0)
+    close(shm_inotify);
+  shm_inotify = -1;
+#endif
+}
+
+static int shm_fd(void)
+{
+#ifdef linux
+  return shm_inotify;
+#else
+  return -1;
+#endif
+}
+
+static int shm_pending(void)
+{
+#ifdef linux
+  char buf[1024];
+  int changed = 0;
+
+  while (read(shm_inotify, buf, sizeof(buf)) > 0)
+    changed = 1;
+  return changed;
+#else
+  return 1;
+#endif
+}
+
+static const struct battery_backend shm_backend = {
+  "shm", shm_probe, shm_open_state, shm_sample, shm_close,
+  shm_fd, shm_pending
+};
+
+#ifdef __bsdi__
+
+#include <machine/apm.h>
+#include <machine/apmioctl.h>
+
+static int apm_probe(void)
+{
+  return access(_PATH_DEVAPM, R_OK) == 0;
+}
+
+static int apm_sample(struct battery_sample *bs)
+{
+  int fd;
+  struct apmreq ar ;
+
+  ar.func = APM_GET_POWER_STATUS ;
+  ar.dev = APM_DEV_ALL ;
+
+  if ((fd = open(_PATH_DEVAPM, O_RDONLY)) < 0) {
+    perror(_PATH_DEVAPM) ;
+    return -1;
+  }
+  if (ioctl(fd, PIOCAPMREQ, &ar) < 0) {
+    fprintf(stderr, "xbattbar: PIOCAPMREQ: APM_GET_POWER_STATUS error 0x%x\n", ar.err);
+  }
+  close (fd);
+
+  bs->ac_line = (ar.bret >> 8) & 0xff;
+  bs->level = ar.cret&0xff;
+  return 0;
+}
+
+static const struct battery_backend apm_backend = {
+  "apm", apm_probe, NULL, apm_sample, NULL, NULL, NULL
+};
+
+#endif /* __bsdi__ */
+
+#ifdef __FreeBSD__
+
+#include <machine/apm_bios.h>
+
+#define APMDEV21       "/dev/apm0"
+#define APMDEV22       "/dev/apm"
+
+#define        APM_STAT_UNKNOWN        255
+
+#define        APM_STAT_LINE_OFF       0
+#define        APM_STAT_LINE_ON        1
+
+#define        APM_STAT_BATT_HIGH      0
+#define        APM_STAT_BATT_LOW       1
+#define        APM_STAT_BATT_CRITICAL  2
+#define        APM_STAT_BATT_CHARGING  3
+
+static int apm_open_dev(void)
+{
+  int fd;
+
+  if ((fd = open(APMDEV21, O_RDWR)) == -1)
+    fd = open(APMDEV22, O_RDWR);
+  return fd;
+}
+
+static int apm_probe(void)
+{
+  int fd;
+
+  if ((fd = apm_open_dev()) == -1)
+    return 0;
+  close(fd);
+  return 1;
+}
+
+static int apm_sample(struct battery_sample *bs)
+{
+  int fd, r, p;
+  struct apm_info     info;
+
+  if ((fd = apm_open_dev()) == -1) {
+    fprintf(stderr, "xbattbar: cannot open apm device\n");
+    return -1;
+  }
+  if (ioctl(fd, APMIO_GETINFO, &info) == -1) {
+    fprintf(stderr, "xbattbar: ioctl APMIO_GETINFO failed\n");
+    close (fd);
+    return -1;
+  }
+  close (fd);
+
+  /* get current status */
+  if (info.ai_batt_life == APM_STAT_UNKNOWN) {
+    switch (info.ai_batt_stat) {
+    case APM_STAT_BATT_HIGH:
+      r = 100;
+      break;
+    case APM_STAT_BATT_LOW:
+      r = 40;
+      break;
+    case APM_STAT_BATT_CRITICAL:
+      r = 10;
+      break;
+    default:        /* expected to be APM_STAT_UNKNOWN */
+      r = 100;
+    }
+  } else if (info.ai_batt_life > 100) {
+    /* some APM BIOSes return values slightly > 100 */
+    r = 100;
+  } else {
+    r = info.ai_batt_life;
+  }
+
+  /* get AC-line status */
+  if (info.ai_acline == APM_STAT_LINE_ON) {
+    p = APM_STAT_LINE_ON;
+  } else {
+    p = APM_STAT_LINE_OFF;
+  }
+
+  bs->ac_line = p;
+  bs->level = r;
+  return 0;
+}
+
+static const struct battery_backend apm_backend = {
+  "apm", apm_probe, NULL, apm_sample, NULL, NULL, NULL
+};
+
+#endif /* __FreeBSD__ */
+
+#ifdef __NetBSD__
+
+#ifndef _NO_APM
+#include <machine/apmvar.h>
+#else
+#define APM_AC_OFF	0x00
+#define APM_AC_ON	0x01
+#endif
+
+#define _PATH_APM_SOCKET       "/var/run/apmdev"
+#define _PATH_APM_CTLDEV       "/dev/apmctl"
+#define _PATH_APM_NORMAL       "/dev/apm"
+
+/*
+ * pre:  fd contains a valid file descriptor of an envsys(4) supporting device
+ *       && ns is the number of sensors
+ *       && etds and ebis are arrays of sufficient size
+ * post: returns 0 and etds and ebis arrays are filled with sensor info
+ *       or returns -1 on failure
+ */
+static int
+fillsensors(int fd, envsys_tre_data_t *etds, envsys_basic_info_t *ebis,
+    size_t ns)
+{
+	int i;
+
+	for (i = 0; i < ns; ++i) {
+		ebis[i].sensor = i;
+		if (ioctl(fd, ENVSYS_GTREINFO, &ebis[i]) == -1) {
+			warn("Can't get sensor info for sensor %d", i);
+			return 0;
+		}
+
+		etds[i].sensor = i;
+		if (ioctl(fd, ENVSYS_GTREDATA, &etds[i]) == -1) {
+			warn("Can't get sensor data for sensor %d", i);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * pre:  fd contains a valid file descriptor of an envsys(4) supporting device
+ * post: returns the number of valid sensors provided by the device
+ *       or -1 on error
  */
 static size_t
 numsensors(int fd)
@@ -893,121 +3723,44 @@ numsensors(int fd)
 static envsys_tre_data_t *etds;
 static envsys_basic_info_t *ebis;
 static int *cetds;
+static size_t nsensors;
 
 #if defined(_PATH_SYSMON) && __NetBSD_Version__ >= 106110000
 #define HAVE_NETBSD_ACPI
 #endif
 
-int first = 1;
-void battery_check(void)
+#ifndef _NO_APM
+static int apm_probe(void)
+{
+       int fd;
+
+       /* the node exists even without apm(4) attached; try to open it */
+       if ((fd = open(_PATH_APM_NORMAL, O_RDONLY)) == -1)
+               return 0;
+       close(fd);
+       return 1;
+}
+
+static int apm_sample(struct battery_sample *bs)
 {
        int fd, r, p;
-#ifndef _NO_APM
        struct apm_power_info info;
-#endif
-       int acpi;
-       size_t ns;
-       size_t cc;
-       char *apmdev;
-       int i;
-
-       acpi = 0;
-       apmdev = _PATH_APM_NORMAL;
-       if ((fd = open(apmdev, O_RDONLY)) == -1) {
-#ifdef HAVE_NETBSD_ACPI
-	       apmdev = _PATH_SYSMON;
-	       fd = open(apmdev, O_RDONLY);
-	       acpi = 1;
-#endif
-       }
-       if (fd < 0) {
-               fprintf(stderr, "xbattbar: cannot open %s device\n", apmdev);
-               exit(1);
-       }
 
-       if (acpi) {
-#ifdef HAVE_NETBSD_ACPI
-		if ((ns = numsensors(fd)) == 0) {
-		       fprintf(stderr, "xbattbar: no sensors found\n");
-               exit(1);
+       if ((fd = open(_PATH_APM_NORMAL, O_RDONLY)) == -1) {
+               fprintf(stderr, "xbattbar: cannot open %s device\n",
+                   _PATH_APM_NORMAL);
+               return -1;
        }
-		if (first) {
-			cetds = (int *)malloc(ns * sizeof(int));
-			etds = (envsys_tre_data_t *)malloc(ns * sizeof(envsys_tre_data_t));
-			ebis = (envsys_basic_info_t *)malloc(ns * sizeof(envsys_basic_info_t));
-
-			if ((cetds == NULL) || (etds == NULL) || (ebis == NULL)) {
-				err(1, "Out of memory");
-			}
-		}
-
-		fillsensors(fd, etds, ebis, ns);
-
-#endif
-#ifndef _NO_APM
-       } else {
 
-	       memset(&info, 0, sizeof(info));
+       memset(&info, 0, sizeof(info));
        if (ioctl(fd, APM_IOC_GETPOWER, &info) != 0) {
                fprintf(stderr, "xbattbar: ioctl APM_IOC_GETPOWER failed\n");
-               exit(1);
-       }
-#endif
+               close(fd);
+               return -1;
        }
-
        close(fd);
 
-       ++elapsed_time;
-
-       if (acpi) {
-#ifdef HAVE_NETBSD_ACPI
-		int32_t rtot = 0, maxtot = 0;
-		int have_pct = 0;
-		p = APM_AC_ON;
-		for (i = 0 ; i < ns ; i++) {
-			if ((etds[i].validflags & ENVSYS_FCURVALID) == 0)
-				continue;
-			cc = strlen(ebis[i].desc);
-			if (strncmp(ebis[i].desc, "acpibat", 7) == 0 &&
-			    (strcmp(&ebis[i].desc[cc - 7], " charge") == 0 ||
-			     strcmp(&ebis[i].desc[cc - 7], " energy") == 0)) {
-				rtot += etds[i].cur.data_s;
-				maxtot += etds[i].max.data_s;
-			}
-			/*
-			 * XXX: We should use acpiacad driver and look for
-			 * " connected", but that's broken on some machines
-			 * and we want this to work everywhere.  With this
-			 * we will occasionally catch a machine conditioning
-			 * a battery while connected, while other machines take
-			 * 10-15 seconds to switch from "charging" to
-			 * "discharging" and vice versa, but this is the best
-			 * compromise.
-			 */
-			if ((ebis[i].units == ENVSYS_SWATTS || ebis[i].units == ENVSYS_SAMPS) &&
-			    etds[i].cur.data_s &&
-			    strncmp(ebis[i].desc, "acpibat", 7) == 0 &&
-			    strcmp(&ebis[i].desc[cc - 14], "discharge rate") == 0) {
-				p = APM_AC_OFF;
-			}
-
-			if (ebis[i].units == ENVSYS_INTEGER &&
-			    strcmp(ebis[i].desc, "battery percent") == 0) {
-				have_pct = 1;
-				r = etds[i].cur.data_s;
-			}
-			if (ebis[i].units == ENVSYS_INDICATOR &&
-			    strcmp(ebis[i].desc, "ACIN present") == 0 &&
-			    etds[i].cur.data_s == 0) {
-				p = APM_AC_OFF;
-			}
-		}
-		if (!have_pct)
-			r = (rtot * 100.0) / maxtot;
-#endif
-#ifndef _NO_APM
-       } else {
-	       /* get current remain */
+       /* get current remain */
        if (info.battery_life > 100) {
                /* some APM BIOSes return values slightly > 100 */
                r = 100;
@@ -1021,48 +3774,723 @@ void battery_check(void)
        } else {
                p = APM_AC_OFF;
        }
-#endif
-       }
 
-       if (first || ac_line != p || battery_level != r) {
-               first = 0;
-               ac_line = p;
-               battery_level = r;
-               redraw();
-       }
+       bs->ac_line = p;
+       bs->level = r;
+       return 0;
+}
+
+static const struct battery_backend apm_backend = {
+       "apm", apm_probe, NULL, apm_sample, NULL, NULL, NULL
+};
+#endif /* !_NO_APM */
+
+#ifdef HAVE_NETBSD_ACPI
+/*
+ * The sensor descriptions are fetched once when the backend is opened,
+ * and the indices of the sensors we look at are kept in cetds[].
+ * Each poll then only fetches the data of those, and enumerates the
+ * sensors again if one of them has gone away (a battery removed).
+ */
+static int envsys_fd = -1;
+static size_t ncetds;
+
+static int envsys_probe(void)
+{
+	return access(_PATH_SYSMON, R_OK) == 0;
+}
+
+static int envsys_wanted(const envsys_basic_info_t *ebi)
+{
+	size_t cc = strlen(ebi->desc);
+
+	if (strncmp(ebi->desc, "acpibat", 7) == 0 && cc >= 14 &&
+	    (strcmp(&ebi->desc[cc - 7], " charge") == 0 ||
+	     strcmp(&ebi->desc[cc - 7], " energy") == 0 ||
+	     strcmp(&ebi->desc[cc - 14], "discharge rate") == 0))
+		return 1;
+	if (ebi->units == ENVSYS_INTEGER &&
+	    strcmp(ebi->desc, "battery percent") == 0)
+		return 1;
+	if (ebi->units == ENVSYS_INDICATOR &&
+	    strcmp(ebi->desc, "ACIN present") == 0)
+		return 1;
+	return 0;
+}
+
+static void envsys_close(void)
+{
+	if (envsys_fd != -1)
+		close(envsys_fd);
+	envsys_fd = -1;
+	free(cetds);
+	free(etds);
+	free(ebis);
+	cetds = NULL;
+	etds = NULL;
+	ebis = NULL;
+	nsensors = 0;
+	ncetds = 0;
+}
+
+static int envsys_open(void)
+{
+	size_t ns, i;
+
+	if ((envsys_fd = open(_PATH_SYSMON, O_RDONLY)) == -1) {
+		fprintf(stderr, "xbattbar: cannot open %s device\n",
+		    _PATH_SYSMON);
+		return -1;
+	}
+	ns = numsensors(envsys_fd);
+	if (ns == 0) {
+		fprintf(stderr, "xbattbar: no sensors found\n");
+		envsys_close();
+		return -1;
+	}
+
+	cetds = (int *)malloc(ns * sizeof(int));
+	etds = (envsys_tre_data_t *)malloc(ns * sizeof(envsys_tre_data_t));
+	ebis = (envsys_basic_info_t *)malloc(ns * sizeof(envsys_basic_info_t));
+
+	if ((cetds == NULL) || (etds == NULL) || (ebis == NULL)) {
+		err(1, "Out of memory");
+	}
+	nsensors = ns;
+
+	if (!fillsensors(envsys_fd, etds, ebis, ns)) {
+		envsys_close();
+		return -1;
+	}
+	ncetds = 0;
+	for (i = 0; i < ns; i++) {
+		if (envsys_wanted(&ebis[i]))
+			cetds[ncetds++] = i;
+	}
+	return 0;
+}
+
+static int envsys_sample(struct battery_sample *bs)
+{
+	int r, p;
+	size_t cc, j;
+	int i;
+	int32_t rtot = 0, maxtot = 0;
+	int have_pct = 0;
+
+	for (j = 0; j < ncetds; j++) {
+		i = cetds[j];
+		etds[i].sensor = i;
+		if (ioctl(envsys_fd, ENVSYS_GTREDATA, &etds[i]) == -1 ||
+		    (etds[i].validflags & ENVSYS_FVALID) == 0)
+			break;
+	}
+	if (j < ncetds) {
+		/* the sensors have changed: enumerate them again */
+		envsys_close();
+		if (envsys_open() == -1)
+			return -1;
+		/* fillsensors() has fetched the data as well */
+	}
+
+	r = 0;
+	p = APM_AC_ON;
+	for (j = 0 ; j < ncetds ; j++) {
+		i = cetds[j];
+		if ((etds[i].validflags & ENVSYS_FCURVALID) == 0)
+			continue;
+		cc = strlen(ebis[i].desc);
+		if (strncmp(ebis[i].desc, "acpibat", 7) == 0 &&
+		    (strcmp(&ebis[i].desc[cc - 7], " charge") == 0 ||
+		     strcmp(&ebis[i].desc[cc - 7], " energy") == 0)) {
+			rtot += etds[i].cur.data_s;
+			maxtot += etds[i].max.data_s;
+		}
+		/*
+		 * XXX: We should use acpiacad driver and look for
+		 * " connected", but that's broken on some machines
+		 * and we want this to work everywhere.  With this
+		 * we will occasionally catch a machine conditioning
+		 * a battery while connected, while other machines take
+		 * 10-15 seconds to switch from "charging" to
+		 * "discharging" and vice versa, but this is the best
+		 * compromise.
+		 */
+		if ((ebis[i].units == ENVSYS_SWATTS || ebis[i].units == ENVSYS_SAMPS) &&
+		    etds[i].cur.data_s &&
+		    strncmp(ebis[i].desc, "acpibat", 7) == 0 &&
+		    strcmp(&ebis[i].desc[cc - 14], "discharge rate") == 0) {
+			p = APM_AC_OFF;
+		}
+
+		if (ebis[i].units == ENVSYS_INTEGER &&
+		    strcmp(ebis[i].desc, "battery percent") == 0) {
+			have_pct = 1;
+			r = etds[i].cur.data_s;
+		}
+		if (ebis[i].units == ENVSYS_INDICATOR &&
+		    strcmp(ebis[i].desc, "ACIN present") == 0 &&
+		    etds[i].cur.data_s == 0) {
+			p = APM_AC_OFF;
+		}
+	}
+	if (!have_pct && maxtot > 0)
+		r = (rtot * 100.0) / maxtot;
+
+	bs->ac_line = p;
+	bs->level = r;
+	return 0;
+}
+
+static const struct battery_backend envsys_backend = {
+	"envsys", envsys_probe, envsys_open, envsys_sample, envsys_close,
+	NULL, NULL
+};
+#endif /* HAVE_NETBSD_ACPI */
+
+#endif /* __NetBSD__ */
+
+
+#ifdef linux
+
+#include <dirent.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/apm_bios.h>
+
+#define APM_PROC	"/proc/apm"
+
+#define        APM_STAT_LINE_OFF       0
+#define        APM_STAT_LINE_ON        1
+
+typedef struct apm_info {
+   char       driver_version[16];
+   int        apm_version_major;
+   int        apm_version_minor;
+   int        apm_flags;
+   int        ac_line_status;
+   int        battery_status;
+   int        battery_flags;
+   int        battery_percentage;
+   int        battery_time;
+   int        using_minutes;
+} apm_info;
+
+/*
+ * sysfs power_supply class:
+ * every supply under sysfs_root is opened once and kept open.
+ * Each poll re-reads the attribute with pread(2) at offset 0,
+ * which makes sysfs regenerate its contents, and parses it in place.
+ * Batteries are added up by their energy; supplies plugged in or
+ * removed later are opened or dropped one by one, on uevents or
+ * when they fail to read.
+ */
+
+#define SYSFS_MAXSUPPLY	16
+#define SYSFS_BUFSIZ	4096	/* sysfs attributes are at most a page */
+
+#define SUPPLY_UNKNOWN	0
+#define SUPPLY_BATTERY	1
+#define SUPPLY_MAINS	2
+
+#define STATUS_UNKNOWN		0
+#define STATUS_CHARGING		1
+#define STATUS_DISCHARGING	2
+#define STATUS_NOTCHARGING	3
+#define STATUS_FULL		4
+
+struct sysfs_supply {
+  char name[32];
+  int type;
+  int fd_uevent;		/* uevent, or -1 */
+  int fd_capacity;		/* fallbacks if uevent is not available */
+  int fd_status;
+  int fd_online;
+};
+
+struct sysfs_values {
+  int type;
+  int device;			/* SCOPE=Device: a mouse, not us */
+  int present;
+  int online;
+  int status;
+  int capacity;
+  long energy_now, energy_full;
+  long charge_now, charge_full;
+  long power_now;		/* uW */
+  long current_now, voltage_now;	/* uA, uV */
+};
+
+static struct sysfs_supply supplies[SYSFS_MAXSUPPLY];
+static int nsupplies = -1;	/* -1: not enumerated yet */
+static char sysfs_skip[SYSFS_MAXSUPPLY][32];	/* neither battery nor mains */
+static int nskip = 0;
+static int uevent_fd = -1;		/* -u, see below */
+
+static int sysfs_parse_type(const char *v, size_t len)
+{
+  if (len == 7 && strncmp(v, "Battery", 7) == 0)
+    return SUPPLY_BATTERY;
+  if (len == 5 && strncmp(v, "Mains", 5) == 0)
+    return SUPPLY_MAINS;
+  return SUPPLY_UNKNOWN;
+}
+
+static int sysfs_parse_status(const char *v, size_t len)
+{
+  if (len == 8 && strncmp(v, "Charging", 8) == 0)
+    return STATUS_CHARGING;
+  if (len == 11 && strncmp(v, "Discharging", 11) == 0)
+    return STATUS_DISCHARGING;
+  if (len == 12 && strncmp(v, "Not charging", 12) == 0)
+    return STATUS_NOTCHARGING;
+  if (len == 4 && strncmp(v, "Full", 4) == 0)
+    return STATUS_FULL;
+  return STATUS_UNKNOWN;
+}
+
+static long sysfs_parse_long(const char *v, size_t len)
+{
+  long n = 0;
+  int neg = 0;
+
+  if (len > 0 && *v == '-') {
+    neg = 1;
+    v++;
+    len--;
+  }
+  while (len > 0 && *v >= '0' && *v <= '9') {
+    n = n * 10 + (*v - '0');
+    v++;
+    len--;
+  }
+  return neg ? -n : n;
+}
+
+static void sysfs_values_init(struct sysfs_values *sv)
+{
+  sv->type = SUPPLY_UNKNOWN;
+  sv->device = 0;
+  sv->present = -1;
+  sv->online = -1;
+  sv->status = STATUS_UNKNOWN;
+  sv->capacity = -1;
+  sv->energy_now = sv->energy_full = -1;
+  sv->charge_now = sv->charge_full = -1;
+  sv->power_now = sv->current_now = sv->voltage_now = -1;
+}
+
+/*
+ * parse "POWER_SUPPLY_<KEY>=<value>" lines in buf[0..len)
+ * without copying or allocating
+ */
+static void sysfs_parse_uevent(const char *buf, size_t len,
+                               struct sysfs_values *sv)
+{
+  static const char prefix[] = "POWER_SUPPLY_";
+  const size_t plen = sizeof(prefix) - 1;
+  const char *p = buf, *end = buf + len;
+
+  while (p < end) {
+    const char *eol = memchr(p, '\n', end - p);
+    const char *eq, *v;
+    size_t klen, vlen;
+
+    if (eol == NULL)
+      eol = end;
+    if ((size_t)(eol - p) <= plen || memcmp(p, prefix, plen) != 0 ||
+        (eq = memchr(p + plen, '=', eol - p - plen)) == NULL)
+      goto next;
+    klen = eq - (p + plen);
+    v = eq + 1;
+    vlen = eol - v;
+
+#define KEY(k) (klen == sizeof(k) - 1 && memcmp(p + plen, k, klen) == 0)
+    if (KEY("TYPE"))
+      sv->type = sysfs_parse_type(v, vlen);
+    else if (KEY("SCOPE"))
+      sv->device = vlen == 6 && strncmp(v, "Device", 6) == 0;
+    else if (KEY("PRESENT"))
+      sv->present = (int)sysfs_parse_long(v, vlen);
+    else if (KEY("ONLINE"))
+      sv->online = (int)sysfs_parse_long(v, vlen);
+    else if (KEY("STATUS"))
+      sv->status = sysfs_parse_status(v, vlen);
+    else if (KEY("CAPACITY"))
+      sv->capacity = (int)sysfs_parse_long(v, vlen);
+    else if (KEY("ENERGY_NOW"))
+      sv->energy_now = sysfs_parse_long(v, vlen);
+    else if (KEY("ENERGY_FULL"))
+      sv->energy_full = sysfs_parse_long(v, vlen);
+    else if (KEY("CHARGE_NOW"))
+      sv->charge_now = sysfs_parse_long(v, vlen);
+    else if (KEY("CHARGE_FULL"))
+      sv->charge_full = sysfs_parse_long(v, vlen);
+    else if (KEY("POWER_NOW"))
+      sv->power_now = sysfs_parse_long(v, vlen);
+    else if (KEY("CURRENT_NOW"))
+      sv->current_now = sysfs_parse_long(v, vlen);
+    else if (KEY("VOLTAGE_NOW"))
+      sv->voltage_now = sysfs_parse_long(v, vlen);
+#undef KEY
+  next:
+    p = eol + 1;
+  }
+}
+
+/*
+ * read a whole attribute from offset 0 into buf;
+ * returns its length without the trailing newline, or -1
+ */
+static ssize_t sysfs_pread(int fd, char *buf, size_t size)
+{
+  ssize_t len;
+
+  do {
+    len = pread(fd, buf, size - 1, 0);
+  } while (len < 0 && errno == EINTR);
+  if (len < 0)
+    return -1;
+  if (len > 0 && buf[len - 1] == '\n')
+    len--;
+  buf[len] = '\0';
+  return len;
+}
+
+static int sysfs_openat(int dfd, const char *attr)
+{
+  return openat(dfd, attr, O_RDONLY | O_CLOEXEC);
+}
+
+static void sysfs_release(struct sysfs_supply *sp)
+{
+  if (sp->fd_uevent >= 0)
+    close(sp->fd_uevent);
+  if (sp->fd_capacity >= 0)
+    close(sp->fd_capacity);
+  if (sp->fd_status >= 0)
+    close(sp->fd_status);
+  if (sp->fd_online >= 0)
+    close(sp->fd_online);
+}
+
+static void sysfs_close(void)
+{
+  int i;
+
+  for (i = 0; i < nsupplies; i++)
+    sysfs_release(&supplies[i]);
+  nsupplies = -1;
+}
+
+/*
+ * open the supply <name> in the directory dirfd and keep its
+ * attribute files open;
+ * returns 0, or -1 if it is neither a battery nor mains of the system
+ */
+static int sysfs_add(int dirfd, const char *name)
+{
+  struct sysfs_supply *sp;
+  struct sysfs_values sv;
+  char buf[SYSFS_BUFSIZ];
+  size_t namelen = strlen(name);
+  ssize_t len;
+  int dfd;
+
+  if (nsupplies < 0)
+    nsupplies = 0;
+  sp = &supplies[nsupplies];
+  if (nsupplies >= SYSFS_MAXSUPPLY || name[0] == '.' ||
+      namelen >= sizeof(sp->name))
+    return -1;
+  if ((dfd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    return -1;
+
+  memcpy(sp->name, name, namelen + 1);
+  sp->type = SUPPLY_UNKNOWN;
+  sp->fd_capacity = sp->fd_status = sp->fd_online = -1;
+  sysfs_values_init(&sv);
+
+  if ((sp->fd_uevent = sysfs_openat(dfd, "uevent")) >= 0 &&
+      (len = sysfs_pread(sp->fd_uevent, buf, sizeof(buf))) >= 0) {
+    sysfs_parse_uevent(buf, (size_t)len, &sv);
+    sp->type = sv.type;
+  }
+  if (sp->type == SUPPLY_UNKNOWN) {
+    /* no usable uevent: fall back to the individual attributes */
+    int fd = sysfs_openat(dfd, "type");
+
+    if (sp->fd_uevent >= 0) {
+      close(sp->fd_uevent);
+      sp->fd_uevent = -1;
+    }
+    if (fd >= 0) {
+      if ((len = sysfs_pread(fd, buf, sizeof(buf))) >= 0)
+        sp->type = sysfs_parse_type(buf, (size_t)len);
+      close(fd);
+    }
+    if ((fd = sysfs_openat(dfd, "scope")) >= 0) {
+      if ((len = sysfs_pread(fd, buf, sizeof(buf))) >= 0)
+        sv.device = len == 6 && strncmp(buf, "Device", 6) == 0;
+      close(fd);
+    }
+    if (sv.device) {
+      /* leave its attributes alone, it is dropped below */
+    } else if (sp->type == SUPPLY_BATTERY) {
+      sp->fd_capacity = sysfs_openat(dfd, "capacity");
+      sp->fd_status = sysfs_openat(dfd, "status");
+    } else if (sp->type == SUPPLY_MAINS) {
+      sp->fd_online = sysfs_openat(dfd, "online");
+    }
+  }
+  close(dfd);
+
+  /* peripherals powering themselves, like a wireless mouse */
+  if (sp->type == SUPPLY_UNKNOWN || sv.device) {
+    if (sp->fd_uevent >= 0)
+      close(sp->fd_uevent);
+    return -1;
+  }
+  nsupplies++;
+  return 0;
+}
+
+/*
+ * drop supplies[i], which has gone away
+ */
+static void sysfs_remove(int i)
+{
+  sysfs_release(&supplies[i]);
+  supplies[i] = supplies[--nsupplies];
+}
+
+static int sysfs_find(const char *name)
+{
+  int i;
+
+  for (i = 0; i < nsupplies; i++)
+    if (strcmp(supplies[i].name, name) == 0)
+      return i;
+  return -1;
+}
+
+/*
+ * enumerate supplies; afterwards the set is only updated on
+ * hotplug uevents, or by sysfs_rescan() without them, and when
+ * a supply fails to read.
+ * returns the number of battery and mains supplies found
+ */
+static int sysfs_enumerate(void)
+{
+  DIR *dir;
+  struct dirent *de;
+
+  nsupplies = 0;
+  nskip = 0;
+  if ((dir = opendir(sysfs_root)) == NULL)
+    return 0;
+  while ((de = readdir(dir)) != NULL)
+    sysfs_add(dirfd(dir), de->d_name);
+  closedir(dir);
+
+  return nsupplies;
 }
 
-#endif /* __NetBSD__ */
+/*
+ * without uevents, catch up with supplies plugged in or removed since
+ * the last look.  sysfs doesn't reliably touch the directory's mtime,
+ * so it is read again every time; that is cheap for the handful of
+ * entries in there, and names already found to be of no interest
+ * are remembered so that they aren't opened on every poll.
+ */
+static void sysfs_rescan(void)
+{
+  DIR *dir;
+  struct dirent *de;
+  char seen[SYSFS_MAXSUPPLY];
+  char skip[SYSFS_MAXSUPPLY][32];
+  int i, n = 0;
 
+  if (nsupplies < 0 || (dir = opendir(sysfs_root)) == NULL)
+    return;
+  memset(seen, 0, sizeof(seen));
+  while ((de = readdir(dir)) != NULL) {
+    if (de->d_name[0] == '.')
+      continue;
+    if ((i = sysfs_find(de->d_name)) >= 0) {
+      seen[i] = 1;
+      continue;
+    }
+    for (i = 0; i < nskip; i++)
+      if (strcmp(sysfs_skip[i], de->d_name) == 0)
+        break;
+    if (i == nskip && sysfs_add(dirfd(dir), de->d_name) == 0) {
+      seen[nsupplies - 1] = 1;
+    } else if (n < SYSFS_MAXSUPPLY &&
+               strlen(de->d_name) < sizeof(skip[n])) {
+      strcpy(skip[n++], de->d_name);
+    }
+  }
+  closedir(dir);
+
+  memcpy(sysfs_skip, skip, sizeof(skip[0]) * n);
+  nskip = n;
+  /* downwards, sysfs_remove() moves the last one into the hole */
+  for (i = nsupplies - 1; i >= 0; i--) {
+    if (!seen[i]) {
+      seen[i] = seen[nsupplies - 1];
+      sysfs_remove(i);
+    }
+  }
+}
 
-#ifdef linux
+/*
+ * re-read one supply; returns -1 if it has gone away
+ */
+static int sysfs_read(struct sysfs_supply *sp, struct sysfs_values *sv)
+{
+  char buf[SYSFS_BUFSIZ];
+  ssize_t len;
 
-#include <errno.h>
-#include <linux/apm_bios.h>
+  sysfs_values_init(sv);
+  sv->type = sp->type;
 
-#define APM_PROC	"/proc/apm"
+  if (sp->fd_uevent >= 0) {
+    if ((len = sysfs_pread(sp->fd_uevent, buf, sizeof(buf))) < 0)
+      return -1;
+    sysfs_parse_uevent(buf, (size_t)len, sv);
+    return 0;
+  }
+  if (sp->fd_capacity >= 0) {
+    if ((len = sysfs_pread(sp->fd_capacity, buf, sizeof(buf))) < 0)
+      return -1;
+    sv->capacity = (int)sysfs_parse_long(buf, (size_t)len);
+  }
+  if (sp->fd_status >= 0) {
+    if ((len = sysfs_pread(sp->fd_status, buf, sizeof(buf))) < 0)
+      return -1;
+    sv->status = sysfs_parse_status(buf, (size_t)len);
+  }
+  if (sp->fd_online >= 0) {
+    if ((len = sysfs_pread(sp->fd_online, buf, sizeof(buf))) < 0)
+      return -1;
+    sv->online = (int)sysfs_parse_long(buf, (size_t)len);
+  }
+  return 0;
+}
 
-#define        APM_STAT_LINE_OFF       0
-#define        APM_STAT_LINE_ON        1
+/*
+ * energy of one battery in mWh; returns -1 if unknown
+ */
+static int sysfs_energy(const struct sysfs_values *sv, long long *now,
+                        long long *full)
+{
+  if (sv->energy_now >= 0 && sv->energy_full > 0) {
+    *now = sv->energy_now / 1000;
+    *full = sv->energy_full / 1000;
+  } else if (sv->charge_now >= 0 && sv->charge_full > 0 &&
+             sv->voltage_now > 0) {
+    /* uAh at the present voltage */
+    *now = (long long)sv->charge_now * sv->voltage_now / 1000000000LL;
+    *full = (long long)sv->charge_full * sv->voltage_now / 1000000000LL;
+  } else {
+    return -1;
+  }
+  return 0;
+}
 
-typedef struct apm_info {
-   char       driver_version[16];
-   int        apm_version_major;
-   int        apm_version_minor;
-   int        apm_flags;
-   int        ac_line_status;
-   int        battery_status;
-   int        battery_flags;
-   int        battery_percentage;
-   int        battery_time;
-   int        using_minutes;
-} apm_info;
+/*
+ * get AC line status and battery level from sysfs;
+ * several batteries are added up, weighted by their energy
+ */
+static int sysfs_sample(struct battery_sample *bs)
+{
+  struct sysfs_values sv;
+  int i, have_mains = 0, mains_online = 0;
+  int charging = 0, discharging = 0;
+  int nbat = 0, nenergy = 0, ncap = 0, cap = 0, rate = -1;
+  long long e_now = 0, e_full = 0, now, full;
+
+  if (uevent_fd < 0)
+    sysfs_rescan();
+  if (nsupplies <= 0 && sysfs_enumerate() == 0) {
+    fprintf(stderr, "xbattbar: no power supply found in %s\n", sysfs_root);
+    return -1;
+  }
+
+  /* downwards, so that removing a supply doesn't skip the next one */
+  for (i = nsupplies - 1; i >= 0; i--) {
+    if (sysfs_read(&supplies[i], &sv) < 0) {
+      sysfs_remove(i);
+      continue;
+    }
+    if (sv.type == SUPPLY_MAINS) {
+      have_mains = 1;
+      if (sv.online > 0)
+        mains_online = 1;
+      continue;
+    }
+    if (sv.type != SUPPLY_BATTERY || sv.present == 0)
+      continue;		/* an empty bay */
+
+    nbat++;
+    if (sv.status == STATUS_CHARGING)
+      charging = 1;
+    else if (sv.status == STATUS_DISCHARGING)
+      discharging = 1;
+    if (sysfs_energy(&sv, &now, &full) == 0) {
+      e_now += now;
+      e_full += full;
+      nenergy++;
+    }
+    if (sv.capacity >= 0) {
+      cap += sv.capacity;
+      ncap++;
+    }
+
+    /* some drivers report the draw as negative while discharging */
+    if (sv.power_now != -1) {
+      rate = (rate < 0 ? 0 : rate) + (int)(labs(sv.power_now) / 1000);
+    } else if (sv.current_now != -1 && sv.voltage_now > 0) {
+      rate = (rate < 0 ? 0 : rate) +
+        (int)((long long)labs(sv.current_now) * sv.voltage_now /
+              1000000000LL);
+    }
+  }
 
+  if (have_mains)
+    bs->ac_line = mains_online ? APM_STAT_LINE_ON : APM_STAT_LINE_OFF;
+  else
+    bs->ac_line = (discharging && !charging) ?
+      APM_STAT_LINE_OFF : APM_STAT_LINE_ON;
+
+  if (nbat > 0 && nenergy == nbat && e_full > 0) {
+    bs->level = (int)(e_now * 100 / e_full);
+    bs->energy = (int)e_now;
+    bs->energy_full = (int)e_full;
+  } else if (ncap > 0) {
+    bs->level = cap / ncap;
+  } else {
+    bs->level = 100;	/* no battery: running on AC */
+  }
+  if (bs->level > 100)
+    bs->level = 100;
+  bs->rate = rate;
 
-int first = 1;
-void battery_check(void)
+  return 0;
+}
+
+/*
+ * legacy /proc/apm interface
+ */
+static int apm_probe(void)
+{
+  return access(APM_PROC, R_OK) == 0;
+}
+
+static int apm_sample(struct battery_sample *bs)
 {
-  int r,p;
+  int r;
   FILE *pt;
   struct apm_info i;
   char buf[100];
@@ -1071,7 +4499,7 @@ void battery_check(void)
   errno = 0;
   if ( (pt = fopen( APM_PROC, "r" )) == NULL) {
     fprintf(stderr, "xbattbar: Can't read proc info: %s\n", strerror(errno));
-    exit(1);
+    return -1;
   }
 
   fgets( buf, sizeof( buf ) - 1, pt );
@@ -1090,27 +4518,545 @@ void battery_check(void)
 
   fclose (pt);
 
-  ++elapsed_time;
-
    /* some APM BIOSes return values slightly > 100 */
    if ( (r = i.battery_percentage) > 100 ){
      r = 100;
    }
+   bs->level = r;
 
    /* get AC-line status */
    if ( i.ac_line_status == APM_STAT_LINE_ON) {
-     p = APM_STAT_LINE_ON;
+     bs->ac_line = APM_STAT_LINE_ON;
    } else {
-     p = APM_STAT_LINE_OFF;
+     bs->ac_line = APM_STAT_LINE_OFF;
    }
+   return 0;
+}
 
-  if (first || ac_line != p || battery_level != r) {
-    first = 0;
-    ac_line = p;
-    battery_level = r;
-    redraw();
+static const struct battery_backend apm_backend = {
+  "apm", apm_probe, NULL, apm_sample, NULL, NULL, NULL
+};
+
+/*
+ * kernel uevents:
+ * a NETLINK_KOBJECT_UEVENT socket reports power_supply changes
+ * (AC plug/unplug, capacity steps) as they happen.
+ * uevent_pending() only needs a datagram socket, so a socketpair(2)
+ * can stand in for the netlink socket when testing.
+ */
+
+#define UEVENT_BUFSIZ	4096
+#define UEVENT_GROUP	1	/* kernel multicast group */
+
+static int uevent_open(void)
+{
+  struct sockaddr_nl sa;
+  int fd;
+
+  fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+              NETLINK_KOBJECT_UEVENT);
+  if (fd < 0)
+    return -1;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.nl_family = AF_NETLINK;
+  sa.nl_groups = UEVENT_GROUP;
+  if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * check "KEY=value" in a NUL separated uevent message
+ */
+static int uevent_has(const char *buf, size_t len, const char *kv)
+{
+  const char *p = buf, *end = buf + len;
+  size_t kvlen = strlen(kv);
+
+  while (p < end) {
+    size_t n = strnlen(p, end - p);
+
+    if (n == kvlen && memcmp(p, kv, kvlen) == 0)
+      return 1;
+    p += n + 1;
+  }
+  return 0;
+}
+
+/*
+ * value of "KEY=" in a NUL separated uevent message, or NULL
+ */
+static const char *uevent_get(const char *buf, size_t len, const char *key)
+{
+  const char *p = buf, *end = buf + len;
+  size_t klen = strlen(key);
+
+  while (p < end) {
+    size_t n = strnlen(p, end - p);
+
+    if (n > klen && memcmp(p, key, klen) == 0 && p + n < end)
+      return p + klen;
+    p += n + 1;
+  }
+  return NULL;
+}
+
+/*
+ * a supply came or went: open or drop just that one
+ */
+static void uevent_hotplug(const char *buf, size_t len)
+{
+  const char *name, *sep;
+  int i, fd;
+
+  if (nsupplies < 0)
+    return;		/* all are enumerated on next check anyway */
+  if ((name = uevent_get(buf, len, "POWER_SUPPLY_NAME=")) == NULL) {
+    if ((name = uevent_get(buf, len, "DEVPATH=")) == NULL)
+      return;
+    if ((sep = strrchr(name, '/')) != NULL)
+      name = sep + 1;
+  }
+
+  i = sysfs_find(name);
+  if (uevent_has(buf, len, "ACTION=remove")) {
+    if (i >= 0)
+      sysfs_remove(i);
+  } else if (i < 0) {
+    if ((fd = open(sysfs_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+      sysfs_add(fd, name);
+      close(fd);
+    }
+  }
+}
+
+/*
+ * drain queued uevents;
+ * returns 1 if any of them concerns the power_supply class
+ */
+static int uevent_pending(int fd)
+{
+  char buf[UEVENT_BUFSIZ];
+  struct sockaddr_nl sa;
+  struct iovec iov;
+  struct msghdr msg;
+  ssize_t len;
+  int changed = 0;
+
+  for (;;) {
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &sa;
+    msg.msg_namelen = sizeof(sa);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    len = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == ENOBUFS) {
+        /* overrun: we may have missed a hotplug, enumerate again */
+        changed = 1;
+        sysfs_close();
+      }
+      break;
+    }
+    if (len == 0)
+      break;
+
+    /* only trust the kernel (pid 0) on a real netlink socket */
+    if (msg.msg_namelen == sizeof(sa) && sa.nl_family == AF_NETLINK &&
+        sa.nl_pid != 0)
+      continue;
+    if (!uevent_has(buf, (size_t)len, "SUBSYSTEM=power_supply"))
+      continue;
+
+    changed = 1;
+    if (uevent_has(buf, (size_t)len, "ACTION=add") ||
+        uevent_has(buf, (size_t)len, "ACTION=remove"))
+      uevent_hotplug(buf, (size_t)len);
+  }
+  return changed;
+}
+
+static int sysfs_probe(void)
+{
+  return nsupplies > 0 || sysfs_enumerate() > 0;
+}
+
+static int sysfs_open(void)
+{
+  if (nsupplies < 0 && sysfs_enumerate() == 0) {
+    fprintf(stderr, "xbattbar: no power supply found in %s\n", sysfs_root);
+    return -1;
+  }
+  if (use_uevent && (uevent_fd = uevent_open()) < 0)
+    perror("xbattbar: uevent socket");
+  return 0;
+}
+
+static void sysfs_backend_close(void)
+{
+  if (uevent_fd >= 0) {
+    close(uevent_fd);
+    uevent_fd = -1;
   }
+  sysfs_close();
+}
+
+static int sysfs_fd(void)
+{
+  return uevent_fd;
+}
+
+static int sysfs_pending(void)
+{
+  return uevent_fd >= 0 && uevent_pending(uevent_fd);
 }
 
+static const struct battery_backend sysfs_backend = {
+  "sysfs", sysfs_probe, sysfs_open, sysfs_sample, sysfs_backend_close,
+  sysfs_fd, sysfs_pending
+};
+
 #endif /* linux */
 
+/*
+ * battery backends, in order of preference
+ */
+static const struct battery_backend *backends[] = {
+  &replay_backend,		/* only usable with a trace */
+  &shm_backend,			/* only usable with -m */
+#ifdef linux
+  &sysfs_backend,
+#endif
+#ifdef __NetBSD__
+#ifndef _NO_APM
+  &apm_backend,			/* preferred, envsys only if no apm(4) */
+#endif
+#ifdef HAVE_NETBSD_ACPI
+  &envsys_backend,
+#endif
+#else /* !__NetBSD__ */
+  &apm_backend,
+#endif
+  NULL
+};
+
+static const struct battery_backend *backend = NULL;
+
+void backend_list(void)
+{
+  const struct battery_backend **bp;
+
+  for (bp = backends; *bp != NULL; bp++)
+    fprintf(stderr, " %s", (*bp)->name);
+}
+
+/*
+ * backend_open:
+ * open the named backend, or the first one available on this host
+ */
+void backend_open(const char *name)
+{
+  const struct battery_backend **bp;
+
+  for (bp = backends; *bp != NULL; bp++) {
+    if (name != NULL ? strcmp((*bp)->name, name) == 0 : (*bp)->probe())
+      break;
+  }
+  if (*bp == NULL) {
+    if (name != NULL)
+      fprintf(stderr, "xbattbar: unknown backend: %s\n", name);
+    else
+      fprintf(stderr, "xbattbar: no battery backend available\n");
+    exit(1);
+  }
+  if ((*bp)->open != NULL && (*bp)->open() < 0)
+    exit(1);
+  backend = *bp;
+}
+
+void backend_close(void)
+{
+  if (backend != NULL && backend->close != NULL)
+    backend->close();
+  backend = NULL;
+}
+
+/*
+ * backend_fd:
+ * file descriptor to wake up on for event driven backends, or -1
+ */
+int backend_fd(void)
+{
+  return backend->fd != NULL ? backend->fd() : -1;
+}
+
+/*
+ * backend_pending:
+ * called when backend_fd() is readable;
+ * returns non-zero if the battery should be sampled now
+ */
+int backend_pending(void)
+{
+  return backend->pending != NULL ? backend->pending() : 1;
+}
+
+/*
+ * battery_update:
+ * the single consumer of samples from any backend;
+ * redraw if anything has changed
+ */
+void battery_update(const struct battery_sample *bs)
+{
+  static int first = 1;
+  static struct timespec change_ts;
+  int shown = remain < 0 ? -1 : remain / 60;
+
+  estimate_update(bs);
+  if (history_mode)
+    history_add(bs);
+  event_push("{\"event\":\"sample\",\"time\":%ld,\"ac\":%d,\"level\":%d,"
+             "\"rate\":%d,\"energy\":%d,\"energy_full\":%d}",
+             (long)time(NULL), bs->ac_line, bs->level, bs->rate,
+             bs->energy, bs->energy_full);
+  if ((remain < 0 ? -1 : remain / 60) != shown) {
+    int i;
+
+    for (i = 0; i < nwidgets; i++)
+      if (widgets[i].tip_mapped)
+        widgets[i].damage |= DAMAGE_TEXT;
+  }
+  poll_changed = 0;
+  if (first || ac_line != bs->ac_line || battery_level != bs->level) {
+    if (!first && ac_line == bs->ac_line) {
+      struct timespec d;
+      int dl = bs->level - battery_level;
+
+      /* how fast the level is moving, for adaptive polling */
+      timespec_sub((struct timespec *)&bs->ts, &change_ts, &d);
+      level_period = (d.tv_sec + d.tv_nsec / 1e9) / (dl < 0 ? -dl : dl);
+    } else {
+      level_period = 0;
+    }
+    change_ts = bs->ts;
+    first = 0;
+    poll_changed = 1;
+    ac_line = bs->ac_line;
+    battery_level = bs->level;
+    event_push("{\"event\":\"state\",\"time\":%ld,\"ac\":%d,\"level\":%d}",
+               (long)time(NULL), ac_line, battery_level);
+    estimate_remain();
+    damage_all(DAMAGE_STATE);
+  } else {
+    stats.redraws_skipped++;
+  }
+}
+
+/*
+ * battery_read:
+ * one sample from the backend, and how long it took to get
+ */
+static int battery_read(struct battery_sample *bs,
+                        struct timespec *t0, struct timespec *t1)
+{
+  int rv;
+
+  clock_gettime(CLOCK_MONOTONIC, t0);
+  bs->ts = *t0;
+  bs->rate = -1;
+  bs->energy = bs->energy_full = -1;
+  rv = backend->sample(bs);
+  clock_gettime(CLOCK_MONOTONIC, t1);
+  return rv;
+}
+
+static void battery_take(const struct battery_sample *bs,
+                         const struct timespec *t0, const struct timespec *t1)
+{
+  stats.samples++;
+  stats_sample_latency(t0, t1);
+  record_sample(bs);
+  shm_publish(bs);
+  persist_sample(bs);
+  battery_update(bs);
+}
+
+void battery_check(void)
+{
+  struct battery_sample bs;
+  struct timespec t0, t1;
+
+  if (battery_read(&bs, &t0, &t1) < 0)
+    exit(1);
+  battery_take(&bs, &t0, &t1);
+}
+
+/*
+ * sampler thread (-w):
+ * some embedded controllers take hundreds of msec to answer, which
+ * would freeze the widgets if read from the main loop.  With -w the
+ * backend belongs to a thread of its own: it samples when asked or
+ * when the backend fd says so, and hands samples over through a
+ * single producer, single consumer ring, then wakes the main loop
+ * with an eventfd (a pipe elsewhere).  The main loop gives a request
+ * -w msec, after which it carries on with the last good sample.
+ */
+#define SAMPLER_RING	8
+
+struct sampler_slot {
+  struct battery_sample bs;
+  struct timespec t0, t1;
+  int status;			/* from backend->sample() */
+  int event;			/* sampled on a backend event */
+};
+
+static struct sampler_slot sampler_ring[SAMPLER_RING];
+static volatile unsigned int sampler_head = 0;	/* next to collect */
+static volatile unsigned int sampler_tail = 0;	/* next to fill */
+static int sampler_req[2] = { -1, -1 };		/* main -> thread */
+static int sampler_done[2] = { -1, -1 };	/* thread -> main */
+
+static void notify_open(int fds[2])
+{
+#ifdef linux
+  fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fds[0] >= 0)
+    return;
+#else
+  if (pipe(fds) == 0) {
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return;
+  }
+#endif
+  perror("xbattbar: sampler");
+  exit(EXIT_FAILURE);
+}
+
+static void notify_send(int fds[2])
+{
+  uint64_t one = 1;		/* an eventfd takes exactly 8 bytes */
+
+  /* a full pipe already has a wakeup pending */
+  if (write(fds[1], &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("xbattbar: sampler");
+}
+
+static void notify_drain(int fds[2])
+{
+  uint64_t buf[8];
+
+  while (read(fds[0], buf, sizeof(buf)) > 0)
+    ;
+}
+
+static void *sampler_main(void *arg)
+{
+  struct pollfd pfd[2];
+  struct sampler_slot *sp;
+  int bfd = backend_fd();
+
+  (void)arg;
+  pfd[0].fd = sampler_req[0];
+  pfd[0].events = POLLIN;
+  pfd[1].fd = bfd;
+  pfd[1].events = POLLIN;
+  for (;;) {
+    int req = 0, ev = 0;
+
+    if (poll(pfd, bfd >= 0 ? 2 : 1, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("xbattbar: sampler");
+      exit(EXIT_FAILURE);
+    }
+    if (pfd[0].revents & POLLIN) {
+      notify_drain(sampler_req);
+      req = 1;
+    }
+    if (bfd >= 0 && (pfd[1].revents & POLLIN) && backend_pending())
+      ev = 1;
+    if (!req && !ev)
+      continue;
+
+    /* full only if the main loop is behind; don't lose samples */
+    while (sampler_tail - sampler_head == SAMPLER_RING) {
+      struct timespec ms = { 0, 1000000 };
+
+      nanosleep(&ms, NULL);
+    }
+    sp = &sampler_ring[sampler_tail % SAMPLER_RING];
+    sp->status = battery_read(&sp->bs, &sp->t0, &sp->t1);
+    sp->event = ev;
+    __sync_synchronize();	/* the slot before the index */
+    sampler_tail++;
+    notify_send(sampler_done);
+  }
+  return NULL;
+}
+
+/*
+ * sampler_start:
+ * returns the fd the main loop waits on for samples
+ */
+int sampler_start(void)
+{
+  pthread_t th;
+  sigset_t all, old;
+
+  notify_open(sampler_req);
+  notify_open(sampler_done);
+
+  /* signals are for the main loop */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  if (pthread_create(&th, NULL, sampler_main, NULL) != 0) {
+    fprintf(stderr, "xbattbar: can't start the sampler thread\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_detach(th);
+  return sampler_done[0];
+}
+
+void sampler_request(void)
+{
+  notify_send(sampler_req);
+}
+
+/*
+ * sampler_collect:
+ * take the samples handed over by the thread, and back off the poll
+ * after each polled one;
+ * returns 0 if there were none, 2 if one came from a backend event
+ */
+int sampler_collect(void)
+{
+  int got = 0;
+
+  notify_drain(sampler_done);
+  while (sampler_head != sampler_tail) {
+    struct sampler_slot *sp = &sampler_ring[sampler_head % SAMPLER_RING];
+
+    __sync_synchronize();	/* the index before the slot */
+    if (sp->status < 0)
+      exit(1);
+    battery_take(&sp->bs, &sp->t0, &sp->t1);
+    if (!sp->event)
+      poll_update();		/* one step per poll, as without -w */
+    if (got < 1 + sp->event)
+      got = 1 + sp->event;
+    __sync_synchronize();	/* done with the slot before freeing it */
+    sampler_head++;
+  }
+  return got;
+}
@@ -0,0 +1,584 @@
+/*
+ * xbattbar_bench: rendering benchmark for xbattbar
+ *
+ * Copyright (c) 1998-2001 Suguru Yamaguchi <suguru@wide.ad.jp>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The drawing code of xbattbar is included as is and driven directly:
+ * every update changes the state, calls redraw() and xflush() the way
+ * the main loop does, and is timed until the frame has been flushed.
+ *
+ * Against a real server (-X starts a private Xvfb) the requests and
+ * bytes per update are read from Xlib.  With -n no server is needed:
+ * the X calls used for drawing are replaced by stubs which only count
+ * requests and their wire size, following Xlib's GC cache closely
+ * enough to tell whether a change adds or saves requests.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <X11/Xlib.h>
+#include <X11/Xlibint.h>	/* bytes in the output buffer */
+
+#define BenchUpdates 10000
+#define BenchTrace 3600		/* samples in the trace for the main loop */
+
+static int bench_null = False;
+
+/*
+ * null display
+ */
+struct null_gc {
+  unsigned long fg;
+  int ox, oy;
+  unsigned int dirty;		/* values not sent yet */
+};
+
+static unsigned long null_reqs = 0, null_bytes = 0;
+static XID null_ids = 0x200000;
+
+static void null_req(unsigned long bytes)
+{
+  null_reqs++;
+  null_bytes += bytes;
+}
+
+static unsigned int null_bits(unsigned long mask)
+{
+  unsigned int n = 0;
+
+  for (; mask; mask &= mask - 1)
+    n++;
+  return n;
+}
+
+static GC null_gc(GC gc)
+{
+  struct null_gc *gp = (struct null_gc *)(void *)gc;
+
+  /* ChangeGC for whatever was set since the last request using it */
+  if (gp->dirty) {
+    null_req(12 + 4 * null_bits(gp->dirty));
+    gp->dirty = 0;
+  }
+  return gc;
+}
+
+static GC null_create_gc(unsigned long mask)
+{
+  struct null_gc *gp = calloc(1, sizeof(*gp));
+
+  if (gp == NULL) {
+    perror("xbattbar_bench");
+    exit(1);
+  }
+  null_req(16 + 4 * null_bits(mask));
+  return (GC)(void *)gp;
+}
+
+static int null_free_gc(GC gc)
+{
+  free(gc);
+  null_req(8);
+  return 1;
+}
+
+static int null_set_fg(GC gc, unsigned long fg)
+{
+  struct null_gc *gp = (struct null_gc *)(void *)gc;
+
+  if (gp->fg != fg) {
+    gp->fg = fg;
+    gp->dirty |= GCForeground;
+  }
+  return 1;
+}
+
+static int null_set_clip_mask(GC gc)
+{
+  ((struct null_gc *)(void *)gc)->dirty |= GCClipMask;
+  null_gc(gc);			/* sent right away by Xlib */
+  return 1;
+}
+
+static int null_set_clip_origin(GC gc, int x, int y)
+{
+  struct null_gc *gp = (struct null_gc *)(void *)gc;
+
+  if (gp->ox != x) {
+    gp->ox = x;
+    gp->dirty |= GCClipXOrigin;
+  }
+  if (gp->oy != y) {
+    gp->oy = y;
+    gp->dirty |= GCClipYOrigin;
+  }
+  return 1;
+}
+
+static int null_draw(GC gc, unsigned long bytes)
+{
+  if (gc != NULL)
+    null_gc(gc);
+  null_req(bytes);
+  return 1;
+}
+
+static XID null_create(unsigned long bytes)
+{
+  null_req(bytes);
+  return ++null_ids;
+}
+
+static int null_flush(void)
+{
+  return 1;
+}
+
+#define NULL_TEXT(n)	(16 + ((2 + (n) + 3) & ~3))	/* PolyText8 */
+
+#define XCreateGC(d, dr, mask, gv) \
+  (bench_null ? null_create_gc(mask) : XCreateGC(d, dr, mask, gv))
+#define XFreeGC(d, gc) \
+  (bench_null ? null_free_gc(gc) : XFreeGC(d, gc))
+#define XSetForeground(d, gc, fg) \
+  (bench_null ? null_set_fg(gc, fg) : XSetForeground(d, gc, fg))
+#define XSetClipMask(d, gc, mask) \
+  (bench_null ? null_set_clip_mask(gc) : XSetClipMask(d, gc, mask))
+#define XSetClipOrigin(d, gc, x, y) \
+  (bench_null ? null_set_clip_origin(gc, x, y) : XSetClipOrigin(d, gc, x, y))
+#define XFillRectangle(d, dr, gc, x, y, w, h) \
+  (bench_null ? null_draw(gc, 20) : XFillRectangle(d, dr, gc, x, y, w, h))
+#define XFillRectangles(d, dr, gc, r, n) \
+  (bench_null ? null_draw(gc, 12 + 8 * (n)) : XFillRectangles(d, dr, gc, r, n))
+#define XDrawRectangle(d, dr, gc, x, y, w, h) \
+  (bench_null ? null_draw(gc, 20) : XDrawRectangle(d, dr, gc, x, y, w, h))
+#define XCopyArea(d, src, dst, gc, sx, sy, w, h, dx, dy) \
+  (bench_null ? null_draw(gc, 28) : \
+   XCopyArea(d, src, dst, gc, sx, sy, w, h, dx, dy))
+#define XDrawString(d, dr, gc, x, y, s, n) \
+  (bench_null ? null_draw(gc, NULL_TEXT(n)) : \
+   XDrawString(d, dr, gc, x, y, s, n))
+#define XCreatePixmap(d, dr, w, h, depth) \
+  (bench_null ? (Pixmap)null_create(16) : XCreatePixmap(d, dr, w, h, depth))
+#define XFreePixmap(d, pix) \
+  (bench_null ? null_draw(NULL, 8) : XFreePixmap(d, pix))
+#define XCreateSimpleWindow(d, p, x, y, w, h, bw, bd, bg) \
+  (bench_null ? (Window)null_create(40) : \
+   XCreateSimpleWindow(d, p, x, y, w, h, bw, bd, bg))
+#define XChangeWindowAttributes(d, w, mask, swa) \
+  (bench_null ? null_draw(NULL, 12 + 4 * null_bits(mask)) : \
+   XChangeWindowAttributes(d, w, mask, swa))
+#define XSelectInput(d, w, mask) \
+  (bench_null ? null_draw(NULL, 16) : XSelectInput(d, w, mask))
+#define XMoveResizeWindow(d, w, x, y, width, height) \
+  (bench_null ? null_draw(NULL, 28) : \
+   XMoveResizeWindow(d, w, x, y, width, height))
+#define XMoveWindow(d, w, x, y) \
+  (bench_null ? null_draw(NULL, 16) : XMoveWindow(d, w, x, y))
+#define XMapRaised(d, w) \
+  (bench_null ? (null_req(16), null_draw(NULL, 8)) : XMapRaised(d, w))
+#define XUnmapWindow(d, w) \
+  (bench_null ? null_draw(NULL, 8) : XUnmapWindow(d, w))
+#define XFlush(d) \
+  (bench_null ? null_flush() : XFlush(d))
+#define XNextRequest(d) \
+  (bench_null ? null_reqs + 1 : XNextRequest(d))
+
+#undef DisplayWidth
+#undef DisplayHeight
+#define DisplayWidth(d, s)	(bench_null ? 1024 : ScreenOfDisplay(d, s)->width)
+#define DisplayHeight(d, s)	(bench_null ? 768 : ScreenOfDisplay(d, s)->height)
+
+#define main xbattbar_main
+#include "xbattbar.c"
+#undef main
+
+static struct widget *bw;	/* the widget under test */
+
+static void null_init(void)
+{
+  static XFontStruct font;
+
+  /* a fixed width font is all XTextExtents() needs to measure */
+  font.fid = null_ids++;
+  font.max_byte1 = 0;
+  font.min_char_or_byte2 = 0;
+  font.max_char_or_byte2 = 255;
+  font.max_bounds.lbearing = 0;
+  font.max_bounds.rbearing = DefaultFontW - 1;
+  font.max_bounds.width = DefaultFontW;
+  font.max_bounds.ascent = DefaultFontH - 3;
+  font.max_bounds.descent = 3;
+  font.min_bounds = font.max_bounds;
+  font.ascent = DefaultFontH - 3;
+  font.descent = 3;
+
+  displays[ndisplays++].fontp = &font;
+  bw = &widgets[nwidgets++];
+  bw->dp = &displays[0];
+  bw->fontp = &font;
+  bw->win = (Window)null_create(32);
+  bw->gc_fill = XCreateGC(NULL, bw->win, 0, NULL);
+  bw->gc_frame = XCreateGC(NULL, bw->win, 0, NULL);
+  bw->gc_text = XCreateGC(NULL, bw->win, GCFont, NULL);
+  bw->pix_bg = 0;
+  bw->pix_fg = 1;
+  bw->onin = 2;
+  bw->onout = 3;
+  bw->offin = 4;
+  bw->offout = 5;
+}
+
+/*
+ * Xvfb on a free display number, for -X
+ */
+static pid_t xvfb_pid = -1;
+
+static void xvfb_start(void)
+{
+  int pfd[2];
+  char fdstr[16], dpy[32];
+  ssize_t n;
+  size_t len = 1;
+
+  if (pipe(pfd) < 0) {
+    perror("xbattbar_bench: pipe");
+    exit(1);
+  }
+  if ((xvfb_pid = fork()) < 0) {
+    perror("xbattbar_bench: fork");
+    exit(1);
+  }
+  if (xvfb_pid == 0) {
+    close(pfd[0]);
+    snprintf(fdstr, sizeof(fdstr), "%d", pfd[1]);
+    execlp("Xvfb", "Xvfb", "-displayfd", fdstr, "-nolisten", "tcp",
+           "-screen", "0", "1024x768x24", (char *)NULL);
+    perror("xbattbar_bench: Xvfb");
+    _exit(127);
+  }
+  close(pfd[1]);
+
+  /* Xvfb writes its display number once it accepts connections */
+  dpy[0] = ':';
+  while (len < sizeof(dpy) - 1 &&
+         (n = read(pfd[0], dpy + len, sizeof(dpy) - 1 - len)) > 0) {
+    len += n;
+    if (dpy[len - 1] == '\n')
+      break;
+  }
+  close(pfd[0]);
+  if (len <= 1) {
+    fprintf(stderr, "xbattbar_bench: Xvfb did not start\n");
+    exit(1);
+  }
+  dpy[len - (dpy[len - 1] == '\n')] = '\0';
+  setenv("DISPLAY", dpy, 1);
+}
+
+static void xvfb_stop(void)
+{
+  if (xvfb_pid > 0) {
+    kill(xvfb_pid, SIGTERM);
+    waitpid(xvfb_pid, NULL, 0);
+    xvfb_pid = -1;
+  }
+}
+
+/*
+ * updates
+ */
+static void update_state(int i)
+{
+  struct battery_sample bs;
+
+  clock_gettime(CLOCK_MONOTONIC, &bs.ts);
+  bs.level = 100 - i % 101;
+  bs.ac_line = (i / 101) & 1;
+  bs.rate = -1;
+  bs.energy = bs.energy_full = -1;
+  battery_update(&bs);
+}
+
+static void update_expose(int i)
+{
+  XExposeEvent ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.x = i % (bw->win_w / 2);
+  ev.y = 0;
+  ev.width = bw->win_w / 2;
+  ev.height = bw->win_h;
+  damage_expose(bw, &ev);
+}
+
+static void update_resize(int i)
+{
+  bw->win_w = (i & 1) ? 128 : 64;
+  bw->damage |= DAMAGE_SIZE;
+}
+
+static void update_tip_move(int i)
+{
+  XEvent ev;
+  int j;
+
+  /* a burst of motion events, as read in one go by the main loop */
+  memset(&ev, 0, sizeof(ev));
+  ev.type = MotionNotify;
+  ev.xmotion.window = bw->win;
+  for (j = 0; j < 4; j++) {
+    ev.xmotion.x_root = 100 + (i * 4 + j) % 200;
+    ev.xmotion.y_root = 100 + (i * 4 + j) % 50;
+    handle_event(bw->dp, &ev);
+  }
+}
+
+static void update_tip_state(int i)
+{
+  update_state(i);
+}
+
+static void update_sample(int i)
+{
+  struct battery_sample bs;
+
+  /* every sample is a new column, changed or not */
+  clock_gettime(CLOCK_MONOTONIC, &bs.ts);
+  bs.level = 100 - i / 10 % 101;
+  bs.ac_line = (i / 1010) & 1;
+  bs.rate = -1;
+  bs.energy = bs.energy_full = -1;
+  battery_update(&bs);
+}
+
+struct scenario {
+  const char *name;
+  void (*update)(int);
+  int tip;			/* with the tooltip mapped */
+  int history;			/* -H */
+  unsigned int w, h;
+};
+
+static const struct scenario scenarios[] = {
+  { "state", update_state, 0, 0, 64, 16 },
+  { "expose", update_expose, 0, 0, 64, 16 },
+  { "resize", update_resize, 0, 0, 64, 16 },
+  { "tip-move", update_tip_move, 1, 0, 64, 16 },
+  { "tip-state", update_tip_state, 1, 0, 64, 16 },
+  { "hist-64", update_sample, 0, 1, 64, 16 },
+  { "hist-512", update_sample, 0, 1, 512, 32 },
+};
+
+static int cmp_ulong(const void *a, const void *b)
+{
+  unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void bench_run(FILE *out, const struct scenario *sp, int n,
+                      unsigned long *lat)
+{
+  struct timespec t0, t1, start, end;
+  unsigned long reqs = 0, bytes = 0, redraws = stats.redraws;
+  unsigned long req0, bytes0;
+  Display *disp = bw->disp;
+  double sec;
+  int i;
+
+  history_mode = sp->history;
+  if (sp->tip)
+    tip_show(bw, 100, 100);
+  bw->win_w = sp->w;
+  bw->win_h = sp->h;
+  bw->damage |= DAMAGE_SIZE;
+  redraw(bw);
+  xflush(bw->dp);
+  if (!bench_null)
+    XSync(disp, True);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < n; i++) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    req0 = XNextRequest(disp);
+    bytes0 = null_bytes;
+    sp->update(i);
+    if (bw->damage)
+      redraw(bw);
+    reqs += XNextRequest(disp) - req0;
+    if (bench_null)
+      bytes += null_bytes - bytes0;
+    else
+      bytes += disp->bufptr - disp->buffer;
+    xflush(bw->dp);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    timespec_sub(&t1, &t0, &t1);
+    lat[i] = (unsigned long)t1.tv_sec * 1000000000 + t1.tv_nsec;
+
+    /* let the server keep up, outside of the timed part */
+    if (!bench_null)
+      XSync(disp, True);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  timespec_sub(&end, &start, &end);
+  sec = end.tv_sec + end.tv_nsec / 1e9;
+
+  if (sp->tip)
+    tip_hide(bw);
+
+  qsort(lat, n, sizeof(*lat), cmp_ulong);
+  fprintf(out, "%-10s %7d %10.0f %8.2f %9.1f %7.1f %7.1f %7.1f %7.1f\n",
+          sp->name, n, (stats.redraws - redraws) / sec,
+          (double)reqs / n, (double)bytes / n,
+          lat[n / 2] / 1e3, lat[n * 9 / 10] / 1e3,
+          lat[n * 99 / 100] / 1e3, lat[n - 1] / 1e3);
+}
+
+/*
+ * run_loop:
+ * replay a synthetic discharge and charge cycle through the
+ * main loop of a real xbattbar as fast as it can take it
+ */
+static void run_loop(FILE *out, const char *prog, int n)
+{
+  char trace[] = "/tmp/xbattbar_bench.XXXXXX";
+  struct battery_sample bs;
+  pid_t pid;
+  int fd, i, status;
+
+  if ((fd = mkstemp(trace)) < 0) {
+    perror("xbattbar_bench: mkstemp");
+    exit(1);
+  }
+  close(fd);
+  unlink(trace);
+  record_open(trace);
+  memset(&bs, 0, sizeof(bs));
+  for (i = 0; i < n; i++) {
+    /* one sample a second, 1% every 18 samples */
+    bs.ts.tv_sec = i;
+    bs.ac_line = i >= n / 2;
+    bs.level = bs.ac_line ? (i - n / 2) / 18 : 100 - i / 18;
+    bs.rate = -1;
+    bs.energy = bs.energy_full = -1;
+    record_sample(&bs);
+  }
+  close(record_fd);
+  record_fd = -1;
+
+  fprintf(out, "main loop: %s -r trace -f, %d samples\n", prog, n);
+  fflush(out);
+  if ((pid = fork()) < 0) {
+    perror("xbattbar_bench: fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    execl(prog, prog, "-r", trace, "-f", (char *)NULL);
+    perror(prog);
+    _exit(127);
+  }
+  waitpid(pid, &status, 0);
+  unlink(trace);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    fprintf(out, "main loop: %s failed\n", prog);
+}
+
+static void bench_usage(char *prog)
+{
+  fprintf(stderr,
+          "usage: %s [-n | -X] [-N updates] [-l xbattbar]\n"
+          "\t-n: null display, only count requests\n"
+          "\t-X: run against a private Xvfb\n"
+          "\t-N: number of updates per scenario (default: %d)\n"
+          "\t-l: also replay a trace through the main loop of xbattbar\n",
+          prog, BenchUpdates);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  int ch, fd, n = BenchUpdates;
+  int xvfb = False;
+  char *loop = NULL;
+  unsigned long *lat;		/* nsec from state change to flush */
+  FILE *out;
+  size_t i;
+
+  while ((ch = getopt(argc, argv, "l:nN:X")) != -1)
+    switch (ch) {
+    case 'l':
+      loop = optarg;
+      break;
+    case 'n':
+      bench_null = True;
+      break;
+    case 'N':
+      n = atoi(optarg);
+      break;
+    case 'X':
+      xvfb = True;
+      break;
+    default:
+      bench_usage(argv[0]);
+    }
+  if (n <= 0 || (bench_null && (xvfb || loop)))
+    bench_usage(argv[0]);
+
+  /* keep the report apart from what xbattbar prints on stdout */
+  if ((fd = dup(1)) < 0 || (out = fdopen(fd, "w")) == NULL ||
+      freopen("/dev/null", "w", stdout) == NULL) {
+    perror("xbattbar_bench");
+    exit(1);
+  }
+  if ((lat = calloc(n, sizeof(*lat))) == NULL) {
+    perror("xbattbar_bench");
+    exit(1);
+  }
+
+  if (xvfb)
+    xvfb_start();
+  if (bench_null)
+    null_init();
+  else {
+    struct xdisplay *dp = InitDisplay(NULL);
+
+    InitWidget(dp, DefaultScreen(dp->disp));
+    bw = &widgets[0];
+  }
+
+  fprintf(out, "display: %s\n",
+          bench_null ? "null" : DisplayString(bw->disp));
+  fprintf(out, "%-10s %7s %10s %8s %9s %7s %7s %7s %7s\n",
+          "scenario", "updates", "redraws/s", "req/upd", "bytes/upd",
+          "p50us", "p90us", "p99us", "maxus");
+  for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+    bench_run(out, &scenarios[i], n, lat);
+
+  if (loop)
+    run_loop(out, loop, BenchTrace);
+
+  fclose(out);
+  xvfb_stop();
+  exit(EXIT_SUCCESS);
+}